@@ -0,0 +1,379 @@
+#pragma once
+
+#include "SpaceInterface.h"
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+Searches an index file that does not fit in memory. The node records ([data] [degree] [M links] [label], or
+[data] [M links] [label] with self-loop padding in older files) stay in the file written by Index::save and
+are read with pread as the search reaches them. Only the following are kept in memory:
+
+1. An 8-bit scalar quantized (SQ8) copy of every vector - 1 byte per dimension instead of 4 - which is used
+   to decide which nodes to visit.
+2. The full records of the cache_nodes nodes closest (in hops) to the entry points, since every search
+   passes through them.
+
+The search is a beam search over the SQ8 distances in the style of DiskANN: at each step it takes the
+beam_width best unexpanded candidates and reads all of their records at once, from a pool of I/O threads
+if num_io_threads > 0. Every record that is read contains the full-precision vector, so the nodes that the
+search expands are re-ranked with exact distances and the top K of those are returned. The number of reads
+per query is about ef_search, and the beam width trades them against the number of I/O round trips.
+
+Only float32 indexes are supported (SQ8 compresses 32-bit floats). Reads go through the OS page cache, which
+the kernel will evict under memory pressure - the process itself only holds the compressed vectors and the
+entry cache. Opening the index makes two sequential passes over the file to train and encode the SQ8 codes.
+Any number of threads can search at once.
+*/
+
+template <typename label_t, typename node_id_t = unsigned int> // node_id_t must match the Index that saved the file
+class DiskIndex {
+  public:
+    typedef std::pair<float, label_t> dist_label_t;
+
+  private:
+    int fd;
+    size_t M;
+    size_t max_num_nodes;
+    size_t cur_num_nodes;
+    size_t data_size_bytes;
+    size_t node_size_bytes;
+    bool padded_links; // true for files without a degree field, whose unused links are self-loops
+    size_t dim;
+    static const size_t HEADER_SIZE = 5*sizeof(size_t);
+
+    DistanceFunction<float> distance;
+    void* distance_param;
+
+    // SQ8: x[d] is approximately sq_min[d] + code[d] * sq_scale[d]
+    std::vector<float> sq_min;
+    std::vector<float> sq_scale;
+    std::vector<uint8_t> codes;
+
+    std::unordered_map<node_id_t, std::vector<char> > entry_cache;
+
+    // A fixed pool of threads that serves batches of preads. Each batch waits for all of its reads.
+    struct ReadRequest {
+      node_id_t node;
+      char* buffer;
+    };
+    struct Batch {
+      std::mutex lock;
+      std::condition_variable done;
+      size_t remaining;
+      std::exception_ptr error; // the first failed read, rethrown on the searching thread
+    };
+    std::vector<std::thread> io_threads;
+    std::queue< std::pair<ReadRequest, Batch*> > io_queue;
+    std::mutex io_lock;
+    std::condition_variable io_ready;
+    bool stopping;
+
+    // Points links at the links of a record and returns their number. Self-loops are only possible with padded_links.
+    size_t recordLinks(const char* record, const node_id_t*& links){
+      const node_id_t* block = reinterpret_cast<const node_id_t*>(record + data_size_bytes);
+      if (padded_links){
+        links = block;
+        return M;
+      }
+      links = block + 1;
+      return block[0];
+    }
+
+    void readNode(node_id_t node, char* buffer){
+      size_t offset = HEADER_SIZE + (size_t)(node)*node_size_bytes;
+      size_t done = 0;
+      while (done < node_size_bytes){
+        ssize_t r = pread(fd, buffer + done, node_size_bytes - done, offset + done);
+        if (r <= 0){ throw std::runtime_error("Failed to read node from index file"); }
+        done += r;
+      }
+    }
+
+    void ioWorker(){
+      while (true){
+        std::pair<ReadRequest, Batch*> job;
+        {
+          std::unique_lock<std::mutex> guard(io_lock);
+          io_ready.wait(guard, [this](){ return stopping || !io_queue.empty(); });
+          if (io_queue.empty()){ return; }
+          job = io_queue.front();
+          io_queue.pop();
+        }
+        // an exception must not escape the thread (that would terminate the process), so it goes back to the search
+        std::exception_ptr error;
+        try {
+          readNode(job.first.node, job.first.buffer);
+        } catch (...){
+          error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(job.second->lock);
+        if (error && !job.second->error){ job.second->error = error; }
+        if (--(job.second->remaining) == 0){
+          job.second->done.notify_one();
+        }
+      }
+    }
+
+    void readBatch(std::vector<ReadRequest>& requests){
+      if (io_threads.empty() || requests.size() == 1){
+        for (ReadRequest& request : requests){
+          readNode(request.node, request.buffer);
+        }
+        return;
+      }
+      Batch batch;
+      batch.remaining = requests.size();
+      {
+        std::lock_guard<std::mutex> guard(io_lock);
+        for (ReadRequest& request : requests){
+          io_queue.emplace(request, &batch);
+        }
+      }
+      io_ready.notify_all();
+      std::unique_lock<std::mutex> guard(batch.lock);
+      batch.done.wait(guard, [&batch](){ return batch.remaining == 0; });
+      if (batch.error){ std::rethrow_exception(batch.error); }
+    }
+
+    // Streams the vectors in the file through fn(node, vector), a chunk of records at a time.
+    template <typename Function>
+    void scanVectors(Function fn){
+      const size_t chunk_nodes = std::max<size_t>(1, (64 << 20) / node_size_bytes);
+      std::vector<char> chunk(chunk_nodes*node_size_bytes);
+      for (size_t begin = 0; begin < cur_num_nodes; begin += chunk_nodes){
+        size_t n = std::min(chunk_nodes, cur_num_nodes - begin);
+        size_t bytes = n*node_size_bytes;
+        size_t done = 0;
+        while (done < bytes){
+          ssize_t r = pread(fd, chunk.data() + done, bytes - done, HEADER_SIZE + begin*node_size_bytes + done);
+          if (r <= 0){ throw std::runtime_error("Failed to read index file"); }
+          done += r;
+        }
+        for (size_t i = 0; i < n; i++){
+          fn(begin + i, reinterpret_cast<const float*>(chunk.data() + i*node_size_bytes));
+        }
+      }
+    }
+
+    void trainAndEncode(){
+      sq_min.assign(dim, std::numeric_limits<float>::max());
+      std::vector<float> sq_max(dim, std::numeric_limits<float>::lowest());
+      scanVectors([&](size_t node, const float* x){
+        for (size_t d = 0; d < dim; d++){
+          sq_min[d] = std::min(sq_min[d], x[d]);
+          sq_max[d] = std::max(sq_max[d], x[d]);
+        }
+      });
+      sq_scale.resize(dim);
+      for (size_t d = 0; d < dim; d++){
+        sq_scale[d] = (sq_max[d] > sq_min[d]) ? (sq_max[d] - sq_min[d]) / 255.0f : 1.0f;
+      }
+      codes.resize(cur_num_nodes*dim);
+      scanVectors([&](size_t node, const float* x){
+        uint8_t* code = codes.data() + node*dim;
+        for (size_t d = 0; d < dim; d++){
+          float c = std::round((x[d] - sq_min[d]) / sq_scale[d]);
+          code[d] = (uint8_t)(std::min(255.0f, std::max(0.0f, c)));
+        }
+      });
+    }
+
+    float approximateDistance(const void* query, node_id_t node, float* decoded){
+      const uint8_t* code = codes.data() + (size_t)(node)*dim;
+      for (size_t d = 0; d < dim; d++){
+        decoded[d] = sq_min[d] + code[d]*sq_scale[d];
+      }
+      return distance(query, decoded, distance_param);
+    }
+
+    // Picks the entry node by scanning n_initializations strided SQ8 codes (in memory, so no reads).
+    node_id_t searchInitialization(const void* query, int n_initializations, float* decoded){
+      size_t step_size = std::max<size_t>(1, cur_num_nodes / std::max(1, n_initializations));
+      float min_dist = std::numeric_limits<float>::max();
+      node_id_t entry_node = 0;
+      for (size_t node = 0; node < cur_num_nodes; node += step_size){
+        float dist = approximateDistance(query, node, decoded);
+        if (dist < min_dist){
+          min_dist = dist;
+          entry_node = node;
+        }
+      }
+      return entry_node;
+    }
+
+    // Caches the records of up to cache_nodes nodes, in BFS order from the strided entry point candidates.
+    void fillEntryCache(size_t cache_nodes, int n_initializations){
+      std::queue<node_id_t> frontier;
+      size_t step_size = std::max<size_t>(1, cur_num_nodes / std::max(1, n_initializations));
+      for (size_t node = 0; node < cur_num_nodes; node += step_size){
+        frontier.push(node);
+      }
+      std::vector<char> record(node_size_bytes);
+      while (!frontier.empty() && entry_cache.size() < cache_nodes){
+        node_id_t node = frontier.front();
+        frontier.pop();
+        if (entry_cache.count(node)){ continue; }
+        readNode(node, record.data());
+        entry_cache[node] = record;
+        const node_id_t* links;
+        size_t degree = recordLinks(record.data(), links);
+        for (size_t i = 0; i < degree; i++){
+          if (links[i] != node){ frontier.push(links[i]); }
+        }
+      }
+    }
+
+  public:
+    // cache_nodes is the number of full node records to keep in memory. The entry cache is filled from the
+    // same strided entry point candidates that search() uses with its default n_initializations (100).
+    DiskIndex(SpaceInterface<float>* space, const std::string& filename, size_t cache_nodes = 0, int num_io_threads = 0):
+      stopping(false) {
+      fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0){ throw std::runtime_error("Unable to open index file " + filename); }
+      size_t header[5];
+      if (pread(fd, header, HEADER_SIZE, 0) != (ssize_t)(HEADER_SIZE)){
+        close(fd);
+        throw std::runtime_error("Unable to read index header from " + filename);
+      }
+      M = header[0];
+      max_num_nodes = header[1];
+      cur_num_nodes = header[2];
+      data_size_bytes = header[3];
+      node_size_bytes = header[4];
+      if (data_size_bytes != space->get_data_size()){
+        close(fd);
+        throw std::invalid_argument("Index file data size does not match the space");
+      }
+      padded_links = (node_size_bytes == data_size_bytes + M*sizeof(node_id_t) + sizeof(label_t));
+      if (node_size_bytes != data_size_bytes + (M+1)*sizeof(node_id_t) + sizeof(label_t) && !padded_links){
+        close(fd);
+        throw std::invalid_argument("Index file was saved with a different node_id_t or label_t");
+      }
+      dim = data_size_bytes / sizeof(float);
+      distance = space->get_dist_func();
+      distance_param = space->get_dist_func_param();
+
+      trainAndEncode();
+      fillEntryCache(cache_nodes, 100);
+      for (int t = 0; t < num_io_threads; t++){
+        io_threads.emplace_back(&DiskIndex::ioWorker, this);
+      }
+    }
+
+    ~DiskIndex(){
+      {
+        std::lock_guard<std::mutex> guard(io_lock);
+        stopping = true;
+      }
+      io_ready.notify_all();
+      for (std::thread& thread : io_threads){
+        thread.join();
+      }
+      close(fd);
+    }
+
+    DiskIndex(const DiskIndex&) = delete;
+    DiskIndex& operator=(const DiskIndex&) = delete;
+
+    // num_reads, if given, is set to the number of records read from disk (entry cache hits are not counted).
+    std::vector< dist_label_t > search(const void* query, const int K, int ef_search, int beam_width = 4,
+      int n_initializations = 100, size_t* num_reads = NULL){
+      std::vector<float> decoded(dim);
+      struct Candidate {
+        float approximate_distance;
+        node_id_t node;
+        bool expanded;
+      };
+      // candidates sorted by SQ8 distance, at most ef_search of them
+      std::vector<Candidate> candidates;
+      std::unordered_set<node_id_t> visited;
+      std::vector<dist_label_t> results; // exact distances of every expanded node
+
+      node_id_t entry_node = searchInitialization(query, n_initializations, decoded.data());
+      candidates.push_back({approximateDistance(query, entry_node, decoded.data()), entry_node, false});
+      visited.insert(entry_node);
+
+      std::vector<char> buffers(beam_width*node_size_bytes);
+      std::vector<const char*> records(beam_width);
+      std::vector<node_id_t> beam;
+      std::vector<ReadRequest> requests;
+      if (num_reads != NULL){ *num_reads = 0; }
+
+      while (true){
+        // the beam_width closest unexpanded candidates
+        beam.clear();
+        for (Candidate& candidate : candidates){
+          if (!candidate.expanded){
+            candidate.expanded = true;
+            beam.push_back(candidate.node);
+            if (beam.size() >= beam_width){ break; }
+          }
+        }
+        if (beam.empty()){ break; }
+
+        requests.clear();
+        for (size_t b = 0; b < beam.size(); b++){
+          auto cached = entry_cache.find(beam[b]);
+          if (cached != entry_cache.end()){
+            records[b] = cached->second.data();
+          } else {
+            requests.push_back({beam[b], buffers.data() + b*node_size_bytes});
+            records[b] = buffers.data() + b*node_size_bytes;
+          }
+        }
+        readBatch(requests);
+        if (num_reads != NULL){ *num_reads += requests.size(); }
+
+        for (size_t b = 0; b < beam.size(); b++){
+          const char* record = records[b];
+          float exact = distance(query, record, distance_param);
+          label_t label;
+          std::memcpy(&label, record + node_size_bytes - sizeof(label_t), sizeof(label_t));
+          results.emplace_back(exact, label);
+
+          const node_id_t* links;
+          size_t degree = recordLinks(record, links);
+          for (size_t i = 0; i < degree; i++){
+            node_id_t neighbor = links[i];
+            if (neighbor == beam[b] || !visited.insert(neighbor).second){ continue; }
+            float dist = approximateDistance(query, neighbor, decoded.data());
+            if (candidates.size() >= ef_search && dist >= candidates.back().approximate_distance){ continue; }
+            Candidate candidate = {dist, neighbor, false};
+            candidates.insert(std::upper_bound(candidates.begin(), candidates.end(), candidate,
+              [](const Candidate& a, const Candidate& b){ return a.approximate_distance < b.approximate_distance; }), candidate);
+            if (candidates.size() > ef_search){ candidates.pop_back(); }
+          }
+        }
+      }
+
+      std::sort(results.begin(), results.end(), [](const dist_label_t& left, const dist_label_t& right)
+        { return left.first < right.first; });
+      if (results.size() > K){ results.resize(K); }
+      return results;
+    }
+
+    size_t size(){ return cur_num_nodes; }
+
+    // Bytes held in memory for the compressed vectors and the entry cache.
+    size_t memory_bytes(){
+      return codes.size() + entry_cache.size()*node_size_bytes + 2*dim*sizeof(float);
+    }
+};
@@ -22,32 +22,32 @@ class ExplicitSet {
   private:
     unsigned short _mark;
     unsigned short *_table;
-    unsigned int _tableSize;
+    size_t _tableSize;
 
   public: 
     ExplicitSet(): _table(NULL), _tableSize(0), _mark(0) {}
 
-    ExplicitSet(const unsigned int size): _table(NULL), _tableSize(0), _mark(0) {
+    ExplicitSet(const size_t size): _table(NULL), _tableSize(0), _mark(0) {
       _mark = 0;
       _tableSize = size;
       _table = new unsigned short[_tableSize]();
     }
 
-    inline void prefetch(const unsigned int num) const {
+    inline void prefetch(const size_t num) const {
         #ifdef USE_SSE
             _mm_prefetch((char*)_table[num], _MM_HINT_T0);
         #endif
     }
 
-    inline void insert(const unsigned int num){
+    inline void insert(const size_t num){
       set(num);
     }
 
-    inline void set(const unsigned int num){
+    inline void set(const size_t num){
       _table[num] = _mark;
     }
     
-    inline void reset(const unsigned int num){
+    inline void reset(const size_t num){
       _table[num] = _mark + 1;
     }
 
@@ -55,7 +55,7 @@ class ExplicitSet {
       _mark++;
     }
 
-    inline bool operator[](const unsigned int num){
+    inline bool operator[](const size_t num){
       return (_table[num] == _mark);
     }
 
@@ -66,9 +66,8 @@ class ExplicitSet {
     ExplicitSet(const ExplicitSet& other){ // copy constructor
       _tableSize = other._tableSize;
       _mark = other._mark;
-      delete[] _table;
       _table = new unsigned short[_tableSize];
-      std::memcpy(other._table, _table, _tableSize * sizeof(unsigned short));
+      std::memcpy(_table, other._table, _tableSize * sizeof(unsigned short));
     }
 
     ExplicitSet(ExplicitSet&& other) noexcept { // move constructor
@@ -87,6 +86,8 @@ class ExplicitSet {
   
       ExplicitSet& operator=(ExplicitSet&& other) noexcept // move assignment
       {
+        if (this == &other){ return *this; }
+        delete[] _table; // our old table, which would otherwise leak (e.g. on every Index::grow)
         _tableSize = other._tableSize;
         _mark = other._mark;
         _table = other._table;
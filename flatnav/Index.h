@@ -12,6 +12,10 @@
 #include "HashBasedBooleanSet.h"
 #include "GorderPriorityQueue.h"
 #include "ExplicitSet.h"
+#include "VisitedSetPool.h"
+#include "ParallelFor.h"
+#include "QueryCache.h"
+#include "NNDescent.h"
 #include "reordering.h"
 
 #include <vector>
@@ -22,9 +26,31 @@
 #include "SpaceInterface.h"
 #include <fstream>
 #include <cstring>
+#include <chrono>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
-template <typename dist_t, typename label_t>
+// node_id_t is the type of the internal node IDs, which are stored M times per node. The default 32-bit IDs
+// limit the index to 4B nodes. Small indexes (up to 65535 nodes) can use 16-bit IDs for half-size link blocks,
+// and very large ones 64-bit IDs. The IDs are stored as-is in the index file, so an index must be loaded with
+// the node_id_t it was saved with.
+// fixed_space_t optionally fixes the metric and dimension at compile time, for inlined and unrolled SIMD query
+// distances (e.g. Index<float, int, unsigned int, L2FixedSpace<128>>, see SpaceInterface.h). The space passed to the
+// constructor must then compute the same distances, or the constructor throws. RuntimeSpace means no fixed dimension.
+template <typename dist_t, typename label_t, typename node_id_t = unsigned int, typename fixed_space_t = RuntimeSpace>
 class Index
 {
 public:
@@ -36,8 +62,34 @@ public:
 	enum class ProfileOrder {GORDER, RCM};
 	typedef std::pair< dist_t, label_t > dist_label_t;
 
+	// The largest supported M. beamSearch keeps the links of the node it expands in fixed-size arrays on the stack.
+	static const int MAX_M = 256;
+
+	// Optional, per-query early termination for beamSearch. An expansion is "unproductive" if it does not change 
+	// the top-K results, or if it improves the K-th distance by less than a fraction min_improvement of its old value.
+	// The search stops after "patience" consecutive unproductive expansions. Easy queries converge quickly and stop 
+	// early, while hard queries keep improving and still get the full ef budget. patience = 0 disables the rule.
+	struct EarlyTermination {
+		int patience;
+		float min_improvement;
+		EarlyTermination(int _patience = 0, float _min_improvement = 0): 
+			patience(_patience), min_improvement(_min_improvement) {}
+	};
+
+	// Optional, per-query search statistics. These are only collected when a SearchStats pointer is passed to 
+	// search(), in which case a separate instantiation of beamSearch is used - the default search path does no counting.
+	struct SearchStats {
+		size_t distance_computations; // includes the distances computed by searchInitialization
+		size_t hops; // number of nodes expanded by beamSearch
+		size_t visited_inserts;
+		dist_t entry_distance; // distance from the query to the entry node chosen by searchInitialization
+		dist_t final_distance; // distance to the worst (ef-th) result in the buffer when the search ends
+		double initialization_ns; // time spent in searchInitialization
+		SearchStats(): distance_computations(0), hops(0), visited_inserts(0),
+			entry_distance(0), final_distance(0), initialization_ns(0) {}
+	};
+
 private:
-	typedef unsigned int node_id_t; // internal node numbering scheme
 	typedef std::pair< dist_t, node_id_t > dist_node_t;
 
 	struct CompareNodes {
@@ -46,40 +98,195 @@ private:
 	};
 
 	typedef ExplicitSet VisitedSet;
+
+	static const uint64_t ROUTER_MAGIC = 0x5245545541524e46; // marks the router trailer in the index file
+	static const uint64_t HIERARCHY_MAGIC = 0x5245594152454948; // marks the hierarchy trailer in the index file
 	typedef std::priority_queue< dist_node_t , std::vector< dist_node_t >, CompareNodes > PriorityQueue;
 
 	char* index_memory;
+	void* mapped_file; // non-NULL if index_memory points into a memory-mapped index file (see load)
+	size_t mapped_size;
 
 	size_t M;
 	size_t data_size_bytes; // size of one data point (we do not support variable-size data e.g. strings)
-	size_t node_size_bytes; // Node consists of: ([data] [M links] [data label]). This layout was selected as 
-	// the one with the best cache performance after trying several options 
+	size_t node_size_bytes; // Node consists of: ([data] [degree] [M links] [data label]). This layout was selected as 
+	// the one with the best cache performance after trying several options. Only the first degree links are
+	// used, so searches skip the unused slots and new links are appended in O(1).
 	size_t max_num_nodes; // determines size of internal pre-allocated memory
 	size_t cur_num_nodes;
 
 	DistanceFunction<dist_t> distance; // call-by-pointer distance function
+	BatchDistanceFunction<dist_t> batch_distance; // optional one-to-many version of distance, NULL if the space has none
+	// Distances from a prepared query (see prepareQuery) to the nodes. Used by every search, including the searches
+	// that add() and the other build methods run for the nodes themselves. Node-to-node distances use distance.
+	SpaceInterface<dist_t>* space;
+	size_t query_context_size; // 0 if the space needs no per-query preparation
+	DistanceFunction<dist_t> query_distance;
+	BatchDistanceFunction<dist_t> query_batch_distance;
 	void* distance_param; // TODO: get rid of this shit. 
 	// distance_param just contains "dimensionality." While it's often known at compile-time, it can be unpleasant to 
 	// specify e.g. via preprocessor directives. Also poses issues for Python libraries, which only know dimensionality at runtime
 
 	VisitedSet is_visited; // remembers which nodes we've visited, to avoid re-computing distances
 	// might be a caching problem - need to profile. I would love to get rid of this in beamSearch.
+	// is_visited is only used by operations that modify the index (add, reorder). Searches and profiling borrow
+	// their visited set from visited_pool instead, so that any number of threads can search concurrently.
+	VisitedSetPool<VisitedSet> visited_pool;
+
+	QueryCache<dist_t, label_t>* query_cache; // optional cache of search results, NULL if disabled
+
+	// Optional read-only compressed links (see compress_links). When compressed_offsets is non-empty, the node
+	// records are just ([data] [data label]) and the links of node n are varint-coded in
+	// compressed_links[linksOffset(n), linksOffset(n+1)). The offsets take 4 bytes per node: each is relative to
+	// the offset of its block of COMPRESSED_BLOCK nodes in compressed_block_offsets. A block holds at most
+	// COMPRESSED_BLOCK * MAX_M * 10 bytes (a varint has at most 10), so this works past 4 GB of links.
+	static const size_t COMPRESSED_BLOCK = 1 << 16;
+	std::vector<uint8_t> compressed_links;
+	std::vector<uint32_t> compressed_offsets;
+	std::vector<uint64_t> compressed_block_offsets;
+
+	// Optional entry point router (see build_router). When present, searchInitialization scans these
+	// router_nodes.size() vectors, stored contiguously in router_data, instead of striding through the arena.
+	std::vector<node_id_t> router_nodes;
+	std::vector<char> router_data;
+
+	// Optional sparse hierarchy over the bottom (flat) graph, as in HNSW (see enable_hierarchy). Layer l holds
+	// a random subset of about N / upper_M^l nodes, identified by their bottom-layer IDs. The hierarchy is only
+	// used to choose the entry node for the bottom layer, which is built and searched exactly as without it.
+	struct UpperLayer {
+		std::vector<node_id_t> nodes; // bottom-layer IDs of the nodes in this layer
+		std::vector<node_id_t> links; // upper_M links (bottom-layer IDs) per node, padded with self-loops
+		std::unordered_map<node_id_t, size_t> position; // bottom-layer ID -> position in nodes
+	};
+	std::vector<UpperLayer> upper_layers; // upper_layers[0] is layer 1, just above the bottom layer
+	size_t upper_M; // 0 if the hierarchy is disabled
+	node_id_t hierarchy_entry; // a node in the top layer
+	std::mt19937 level_generator;
+
+	// Everything besides the query that determines the results of search(), used as part of the cache key.
+	struct CacheKeyParams {
+		int K;
+		int ef_search;
+		int n_initializations;
+		int patience;
+		float min_improvement;
+	};
 
 	char* nodeData(const node_id_t& n){
 		char* location = index_memory + n*node_size_bytes;
 		return location;
 	}
 
-	node_id_t* nodeLinks(const node_id_t& n){
+	node_id_t* nodeDegree(const node_id_t& n){
 		char* location = index_memory + n*node_size_bytes + data_size_bytes;
 		return reinterpret_cast<node_id_t*>(location);
 	}
 
+	node_id_t* nodeLinks(const node_id_t& n){
+		char* location = index_memory + n*node_size_bytes + data_size_bytes + sizeof(node_id_t);
+		return reinterpret_cast<node_id_t*>(location);
+	}
+
+	void setLinks(node_id_t node, const node_id_t* links, int degree){
+		std::memcpy(nodeLinks(node), links, degree*sizeof(node_id_t));
+		*(nodeDegree(node)) = degree;
+	}
+
 	label_t* nodeLabel(const node_id_t& n){
-		char* location = index_memory + n*node_size_bytes + data_size_bytes + M*sizeof(node_id_t);
+		// the label ends the record, with or without the links in front of it (see compress_links)
+		char* location = index_memory + n*node_size_bytes + node_size_bytes - sizeof(label_t);
 		return reinterpret_cast<label_t*>(location);
 	}
 
+	void distanceBatch(const void* query, const void* const* data, size_t n, dist_t* out){
+		// out[i] = distance(query, data[i]), using the batched kernel of the space if there is one
+		if (fixed_space_t::dim != 0){
+			fixed_space_t::batch(query, data, n, out);
+			return;
+		}
+		if (batch_distance != NULL){
+			batch_distance(query, data, n, out, distance_param);
+			return;
+		}
+		for (size_t i = 0; i < n; i++){
+			out[i] = distance(query, data[i], distance_param);
+		}
+	}
+
+	dist_t queryDistance(const void* context, const void* data){
+		// distance from a prepared query to data. The fixed_space_t::dim tests are resolved at compile time.
+		if (fixed_space_t::dim != 0){ return fixed_space_t::distance(context, data); }
+		return query_distance(context, data, distance_param);
+	}
+
+	void queryDistanceBatch(const void* context, const void* const* data, size_t n, dist_t* out){
+		// the same, for n vectors at once
+		if (fixed_space_t::dim != 0){
+			fixed_space_t::batch(context, data, n, out);
+			return;
+		}
+		if (query_batch_distance != NULL){
+			query_batch_distance(context, data, n, out, distance_param);
+			return;
+		}
+		for (size_t i = 0; i < n; i++){
+			out[i] = query_distance(context, data[i], distance_param);
+		}
+	}
+
+	const void* prepareQuery(const void* query, std::vector<char>& context){
+		// Returns the prepared form of query (see SpaceInterface::prepare_query), which is what the search
+		// functions below take as their "query". Most spaces need no preparation, and then this is the query itself.
+		if (query_context_size == 0){ return query; }
+		context.resize(query_context_size);
+		space->prepare_query(query, context.data());
+		return context.data();
+	}
+
+	void setSpace(SpaceInterface<dist_t>* _space){
+		if (!fixed_space_t::matches(_space)){
+			throw std::invalid_argument("Space does not match the fixed_space_t of the index");
+		}
+		space = _space;
+		distance_param = space->get_dist_func_param();
+		distance = space->get_dist_func();
+		batch_distance = space->get_batch_dist_func();
+		query_context_size = space->get_query_context_size();
+		query_distance = space->get_query_dist_func();
+		query_batch_distance = space->get_query_batch_dist_func();
+	}
+
+	size_t linksOffset(size_t node) const {
+		return compressed_block_offsets[node / COMPRESSED_BLOCK] + compressed_offsets[node];
+	}
+
+	int decodeLinks(node_id_t node, node_id_t* links) const {
+		// decodes the compressed links of node (see compress_links) into links. Returns the number of links.
+		const uint8_t* code = compressed_links.data() + linksOffset(node);
+		const uint8_t* end = compressed_links.data() + linksOffset((size_t)(node) + 1);
+		int degree = 0;
+		node_id_t previous = node;
+		while (code < end){
+			uint64_t value = 0;
+			int shift = 0;
+			while (*code & 0x80){
+				value |= (uint64_t)(*code & 0x7f) << shift;
+				shift += 7;
+				code++;
+			}
+			value |= (uint64_t)(*code) << shift;
+			code++;
+			if (degree == 0){
+				// the first link is relative to the node itself, zigzag-coded since it can be lower
+				previous = (node_id_t)((int64_t)(node) + (int64_t)((value >> 1) ^ (~(value & 1) + 1)));
+			} else {
+				previous += (node_id_t)(value);
+			}
+			links[degree++] = previous;
+		}
+		return degree;
+	}
+
 	bool allocateNode(void* data, label_t& label, node_id_t& new_node_id){
 		if (cur_num_nodes >= max_num_nodes){return false;}
 		new_node_id = cur_num_nodes; 
@@ -87,27 +294,44 @@ private:
 		std::memcpy(nodeData(cur_num_nodes), data, data_size_bytes);
 		*(nodeLabel(cur_num_nodes)) = label;
 
-		node_id_t* links = nodeLinks(cur_num_nodes);
-		for (int i = 0; i < M; i++){
-			links[i] = cur_num_nodes;
-		}
+		*(nodeDegree(cur_num_nodes)) = 0;
 
 		cur_num_nodes++;
 		return true;
 	}
 
-	PriorityQueue beamSearch(const void* query, const node_id_t entry_node, const int buffer_size){
+	// beamSearch, rangeBeamSearch and the initialization functions take a prepared query (see prepareQuery).
+	template <bool collect_stats = false>
+	PriorityQueue beamSearch(const void* query, const node_id_t entry_node, const int buffer_size, VisitedSet& visited,
+		const int K = 0, const EarlyTermination* termination = NULL, SearchStats* stats = NULL){
 		// returns an iterable list of node_id_t's, sorted by distance (ascending)
 		PriorityQueue neighbors; // W in the paper
 		PriorityQueue candidates; // C in the paper
 
-		is_visited.clear();
-		dist_t dist = distance(query, nodeData(entry_node), distance_param);
+		visited.clear();
+		dist_t dist = queryDistance(query, nodeData(entry_node));
 		dist_t max_dist = dist;
 
 		candidates.emplace(-dist, entry_node);
 		neighbors.emplace(dist, entry_node);
-		is_visited.insert(entry_node);
+		visited.insert(entry_node);
+		if (collect_stats){
+			stats->distance_computations++;
+			stats->visited_inserts++;
+			stats->entry_distance = dist;
+		}
+
+		// early termination state: distances of the current top-K, and the number of unproductive expansions
+		bool adaptive = (termination != NULL) && (termination->patience > 0) && (K > 0);
+		std::priority_queue<dist_t> top_k;
+		int num_unproductive = 0;
+		if (adaptive){ top_k.push(dist); }
+
+		node_id_t decoded_links[MAX_M];
+		// the unvisited neighbors of the node being expanded, whose distances are computed in one batch
+		node_id_t batch_nodes[MAX_M];
+		const void* batch_data[MAX_M];
+		dist_t batch_distances[MAX_M];
 
 		while (!candidates.empty()) {
 			// get nearest element from candidates
@@ -116,22 +340,130 @@ private:
 				break;
 			}
 			candidates.pop();
-			node_id_t* d_node_links = nodeLinks(d_node.second);
-			for (int i = 0; i < M; i++){
-				if (!is_visited[d_node_links[i]]){ // if we haven't visited the node yet
-					is_visited.insert(d_node_links[i]);
-					dist = distance(query, nodeData(d_node_links[i]), distance_param);
-					// Include the node in the buffer if buffer isn't full or if node is closer than a node already in the buffer
-					if (neighbors.size() < buffer_size || dist < max_dist) {
-						candidates.emplace(-dist, d_node_links[i]);
-						neighbors.emplace(dist, d_node_links[i]);
-						if (neighbors.size() > buffer_size){
-							neighbors.pop();
-						}
-						if (!neighbors.empty()){
-							max_dist = neighbors.top().first;
-						}
+			if (collect_stats){ stats->hops++; }
+			bool top_k_changed = false;
+			bool top_k_was_full = adaptive && (top_k.size() >= K);
+			dist_t kth_dist = adaptive ? top_k.top() : 0;
+
+			node_id_t* d_node_links;
+			int degree;
+			if (compressed_offsets.empty()){
+				d_node_links = nodeLinks(d_node.second);
+				degree = *(nodeDegree(d_node.second));
+			} else {
+				d_node_links = decoded_links;
+				degree = decodeLinks(d_node.second, d_node_links);
+			}
+			int num_unvisited = 0;
+			for (int i = 0; i < degree; i++){
+				if (!visited[d_node_links[i]]){ // if we haven't visited the node yet
+					visited.insert(d_node_links[i]);
+					batch_nodes[num_unvisited] = d_node_links[i];
+					batch_data[num_unvisited] = nodeData(d_node_links[i]);
+					num_unvisited++;
+				}
+			}
+			queryDistanceBatch(query, batch_data, num_unvisited, batch_distances);
+			if (collect_stats){
+				stats->visited_inserts += num_unvisited;
+				stats->distance_computations += num_unvisited;
+			}
+			for (int i = 0; i < num_unvisited; i++){
+				dist = batch_distances[i];
+				if (adaptive && (top_k.size() < K || dist < top_k.top())){
+					top_k.push(dist);
+					if (top_k.size() > K){
+						top_k.pop();
+					}
+					top_k_changed = true;
+				}
+				// Include the node in the buffer if buffer isn't full or if node is closer than a node already in the buffer
+				if (neighbors.size() < buffer_size || dist < max_dist) {
+					candidates.emplace(-dist, batch_nodes[i]);
+					neighbors.emplace(dist, batch_nodes[i]);
+					if (neighbors.size() > buffer_size){
+						neighbors.pop();
+					}
+					if (!neighbors.empty()){
+						max_dist = neighbors.top().first;
+					}
+				}
+			}
+
+			if (adaptive){
+				bool is_productive = top_k_changed;
+				if (top_k_changed && top_k_was_full && termination->min_improvement > 0){
+					double improvement = (double)(kth_dist - top_k.top());
+					double scale = (kth_dist < 0) ? -(double)kth_dist : (double)kth_dist;
+					is_productive = (improvement > termination->min_improvement * scale);
+				}
+				num_unproductive = is_productive ? 0 : num_unproductive + 1;
+				if (num_unproductive >= termination->patience){
+					break;
+				}
+			}
+		}
+		if (collect_stats){
+			stats->final_distance = neighbors.top().first;
+		}
+		return neighbors;
+	}
+
+	PriorityQueue rangeBeamSearch(const void* query, const node_id_t entry_node, const dist_t radius, const int buffer_size,
+		VisitedSet& visited){
+		// beamSearch, except that every node within the radius is kept in the buffer. The buffer grows past
+		// buffer_size as long as in-radius nodes are found, and we only stop once the frontier holds no
+		// candidate that is within the radius or closer than the buffer_size-th result.
+		PriorityQueue neighbors; // W in the paper
+		PriorityQueue candidates; // C in the paper
+
+		visited.clear();
+		dist_t dist = queryDistance(query, nodeData(entry_node));
+		dist_t max_dist = dist;
+
+		candidates.emplace(-dist, entry_node);
+		neighbors.emplace(dist, entry_node);
+		visited.insert(entry_node);
+		node_id_t decoded_links[MAX_M];
+		node_id_t batch_nodes[MAX_M];
+		const void* batch_data[MAX_M];
+		dist_t batch_distances[MAX_M];
+
+		while (!candidates.empty()) {
+			dist_node_t d_node = candidates.top();
+			if ((-d_node.first) > max_dist && (-d_node.first) > radius){
+				break;
+			}
+			candidates.pop();
+			node_id_t* d_node_links;
+			int degree;
+			if (compressed_offsets.empty()){
+				d_node_links = nodeLinks(d_node.second);
+				degree = *(nodeDegree(d_node.second));
+			} else {
+				d_node_links = decoded_links;
+				degree = decodeLinks(d_node.second, d_node_links);
+			}
+			int num_unvisited = 0;
+			for (int i = 0; i < degree; i++){
+				if (!visited[d_node_links[i]]){
+					visited.insert(d_node_links[i]);
+					batch_nodes[num_unvisited] = d_node_links[i];
+					batch_data[num_unvisited] = nodeData(d_node_links[i]);
+					num_unvisited++;
+				}
+			}
+			queryDistanceBatch(query, batch_data, num_unvisited, batch_distances);
+			for (int i = 0; i < num_unvisited; i++){
+				dist = batch_distances[i];
+				if (neighbors.size() < buffer_size || dist < max_dist || dist <= radius) {
+					candidates.emplace(-dist, batch_nodes[i]);
+					neighbors.emplace(dist, batch_nodes[i]);
+					// only evict results that are outside the radius
+					while (neighbors.size() > buffer_size && neighbors.top().first > radius){
+						neighbors.pop();
 					}
+					max_dist = neighbors.top().first;
 				}
 			}
 		}
@@ -140,26 +472,176 @@ private:
 
   void reprune(node_id_t node){
     node_id_t* links = nodeLinks(node);
+    int degree = *(nodeDegree(node));
     PriorityQueue neighbors;
-    for (int i = 0; i < M; i++){
-      if (links[i] != node){
-        dist_t dist = distance(nodeData(node), nodeData(links[i]), distance_param);
-        neighbors.emplace(dist, links[i]);
-        links[i] = node;
-      }
+    for (int i = 0; i < degree; i++){
+      dist_t dist = distance(nodeData(node), nodeData(links[i]), distance_param);
+      neighbors.emplace(dist, links[i]);
     }
     selectNeighbors(neighbors, M);
     int i = 0;
-    while(neighbors.size() > 0){
-      node_id_t neighbor_node_id = neighbors.top().second;
-      links[i] = neighbor_node_id;
+    while(neighbors.size() > 0 && i < M){
+      links[i] = neighbors.top().second;
       i++;
-      if (i > M){i = M;}
       neighbors.pop();
     }
+    *(nodeDegree(node)) = i;
   }
 
 
+	bool addLink(node_id_t from, node_id_t to, bool force = false){
+		// adds the directed edge from -> to, appending it if there is a free slot. Otherwise, it replaces the farthest
+		// link, but only if that link is farther than "to" (or if force is true). Returns true if from links to "to".
+		node_id_t* links = nodeLinks(from);
+		int degree = *(nodeDegree(from));
+		if (std::find(links, links + degree, to) != links + degree){ return true; }
+		if (degree < M){
+			links[degree] = to;
+			*(nodeDegree(from)) = degree + 1;
+			return true;
+		}
+		int slot = 0;
+		dist_t max_dist = 0;
+		for (int i = 0; i < M; i++){
+			dist_t dist = distance(nodeData(from), nodeData(links[i]), distance_param);
+			if (i == 0 || dist > max_dist){
+				max_dist = dist;
+				slot = i;
+			}
+		}
+		if (!force && !(distance(nodeData(from), nodeData(to), distance_param) < max_dist)){ return false; }
+		links[slot] = to;
+		return true;
+	}
+
+	int relinkNode(node_id_t node, node_id_t entry_node, int ef_construction, node_id_t* new_links){
+		// searches the graph for the neighbors of node, starting from entry_node, and writes the pruned union of
+		// the results and node's current links to new_links (up to M entries). Returns the number of new links.
+		// Read-only, so this can run on many nodes at once.
+		const void* data = nodeData(node);
+		std::vector<char> context;
+		VisitedSet* visited = visited_pool.acquire();
+		PriorityQueue results = beamSearch(prepareQuery(data, context), entry_node, ef_construction, *visited);
+		visited_pool.release(visited);
+
+		std::vector<dist_node_t> candidates;
+		while (!results.empty()){
+			if (results.top().second != node){ candidates.push_back(results.top()); }
+			results.pop();
+		}
+		size_t num_found = candidates.size();
+		node_id_t* links = nodeLinks(node);
+		int degree = *(nodeDegree(node));
+		for (int i = 0; i < degree; i++){
+			bool found = false;
+			for (size_t j = 0; j < num_found && !found; j++){
+				found = (candidates[j].second == links[i]);
+			}
+			if (!found){
+				candidates.emplace_back(distance(data, nodeData(links[i]), distance_param), links[i]);
+			}
+		}
+
+		PriorityQueue neighbors(candidates.begin(), candidates.end());
+		selectNeighbors(neighbors, M);
+		int new_degree = 0;
+		for (; !neighbors.empty() && new_degree < M; new_degree++){
+			new_links[new_degree] = neighbors.top().second;
+			neighbors.pop();
+		}
+		return new_degree;
+	}
+
+	void addReverseEdges(int num_threads, node_id_t first_source = 0, node_id_t last_source = 0){
+		// adds the reverse of every edge out of the nodes in [first_source, last_source) (all nodes if last_source is 0),
+		// pruning wherever a node would exceed M links. Each node only writes its own links, so no locking is needed.
+		if (last_source == 0){ last_source = cur_num_nodes; }
+		std::vector< std::vector<node_id_t> > reverse(cur_num_nodes);
+		for (node_id_t node = first_source; node < last_source; node++){
+			node_id_t* links = nodeLinks(node);
+			int degree = *(nodeDegree(node));
+			for (int i = 0; i < degree; i++){
+				reverse[links[i]].push_back(node);
+			}
+		}
+		parallel_for(0, cur_num_nodes, num_threads, [&](size_t node, int thread_id){
+			if (reverse[node].empty()){ return; }
+			node_id_t* links = nodeLinks(node);
+			std::vector<node_id_t> merged(links, links + *(nodeDegree(node)));
+			for (node_id_t source : reverse[node]){
+				if (std::find(merged.begin(), merged.end(), source) == merged.end()){ merged.push_back(source); }
+			}
+			if (merged.size() > M){
+				PriorityQueue neighbors;
+				for (node_id_t neighbor : merged){
+					neighbors.emplace(distance(nodeData(node), nodeData(neighbor), distance_param), neighbor);
+				}
+				selectNeighbors(neighbors, M);
+				merged.clear();
+				while (!neighbors.empty()){
+					merged.push_back(neighbors.top().second);
+					neighbors.pop();
+				}
+			}
+			setLinks(node, merged.data(), merged.size());
+		});
+	}
+
+	void connectComponents(int ef_construction){
+		// A graph built only from near neighbors (see bulk_build) can split into one component per cluster,
+		// since the pruning heuristic discards every long edge. We walk the graph from node 0 and link each
+		// node that cannot be reached to a nearby reachable node (found by searching from node 0), in both directions.
+		// The incoming link comes from the nearest search result with a free slot. Only if they are all full do we
+		// evict a link, which can cut off nodes that we have already marked as reached, so then we walk again.
+		// We give up after 10 walks, which can leave nodes unreachable (see connected).
+		std::vector<bool> reached;
+		std::vector<node_id_t> stack;
+		auto markReachable = [&](node_id_t start){
+			reached[start] = true;
+			stack.push_back(start);
+			while (!stack.empty()){
+				node_id_t* links = nodeLinks(stack.back());
+				int degree = *(nodeDegree(stack.back()));
+				stack.pop_back();
+				for (int i = 0; i < degree; i++){
+					if (!reached[links[i]]){
+						reached[links[i]] = true;
+						stack.push_back(links[i]);
+					}
+				}
+			}
+		};
+		std::vector<char> context;
+		std::vector<node_id_t> results;
+		bool evicted = true;
+		for (int pass = 0; evicted && pass < 10; pass++){
+			evicted = false;
+			reached.assign(cur_num_nodes, false);
+			markReachable(0);
+			for (node_id_t node = 0; node < cur_num_nodes; node++){
+				if (reached[node]){ continue; }
+				PriorityQueue neighbors = beamSearch(prepareQuery(nodeData(node), context), 0, ef_construction, is_visited);
+				results.clear();
+				while (!neighbors.empty()){
+					results.push_back(neighbors.top().second);
+					neighbors.pop();
+				}
+				// results are now sorted from farthest to nearest
+				node_id_t source = results.back();
+				for (size_t i = results.size(); i > 0; i--){
+					if (*(nodeDegree(results[i-1])) < M){
+						source = results[i-1];
+						break;
+					}
+				}
+				evicted = evicted || (*(nodeDegree(source)) == M);
+				addLink(source, node, true);
+				addLink(node, source);
+				markReachable(node);
+			}
+		}
+	}
+
 	void selectNeighbors(PriorityQueue& neighbors, const int M){
 		// selects neighbors from the PriorityQueue, according to HNSW heuristic
 		if (neighbors.size() < M) { return; }
@@ -177,11 +659,21 @@ private:
 			candidates.pop();
 
 			bool should_keep_candidate = true; 
-			for (const dist_node_t& second_pair : saved_candidates) {
-				dist_t cur_dist = distance(nodeData(second_pair.second), nodeData(current_pair.second), distance_param);
-				if (cur_dist < (-current_pair.first) ){
-					should_keep_candidate = false; 
-					break;
+			// distances to the saved candidates are computed in small batches, so that we can still stop early
+			const void* current_data = nodeData(current_pair.second);
+			for (size_t i = 0; i < saved_candidates.size() && should_keep_candidate; i += 4){
+				size_t n = std::min<size_t>(4, saved_candidates.size() - i);
+				const void* batch_data[4];
+				dist_t batch_distances[4];
+				for (size_t j = 0; j < n; j++){
+					batch_data[j] = nodeData(saved_candidates[i + j].second);
+				}
+				distanceBatch(current_data, batch_data, n, batch_distances);
+				for (size_t j = 0; j < n; j++){
+					if (batch_distances[j] < (-current_pair.first) ){
+						should_keep_candidate = false; 
+						break;
+					}
 				}
 			}
 			if (should_keep_candidate) {
@@ -205,16 +697,11 @@ private:
 			new_node_links[i] = neighbor_node_id; 
 			// now do the back-connections (a little tricky)
 			node_id_t* neighbor_node_links = nodeLinks(neighbor_node_id);
-			bool is_inserted = false;
-			for (int j = 0; j < M; j++){
-				if (neighbor_node_links[j] == neighbor_node_id){
-					// if there is a self-loop, replace the self-loop with the desired link
-					neighbor_node_links[j] = new_node_id;
-					is_inserted = true; 
-					break;
-				}
-			}
-			if (!is_inserted){
+			node_id_t* neighbor_node_degree = nodeDegree(neighbor_node_id);
+			if (*neighbor_node_degree < M){
+				// if there is a free slot, append the desired link
+				neighbor_node_links[(*neighbor_node_degree)++] = new_node_id;
+			} else {
 				// now, we may to replace one of the links. This will disconnect the old neighbor and 
 				// create a directed edge, so we have to be very careful. To ensure we respect the 
 				// pruning heuristic, we construct a candidate set including the old links AND our new one
@@ -223,117 +710,272 @@ private:
 				PriorityQueue candidates; 
 				candidates.emplace(max_dist, new_node_id);
 				for (int j = 0; j < M; j++){
-					if (neighbor_node_links[j] != neighbor_node_id){
-						candidates.emplace(
-							distance(nodeData(neighbor_node_id),nodeData(neighbor_node_links[j]),distance_param),
-							neighbor_node_links[j]
-							);
-					}
+					candidates.emplace(
+						distance(nodeData(neighbor_node_id),nodeData(neighbor_node_links[j]),distance_param),
+						neighbor_node_links[j]
+						);
 				}
 				selectNeighbors(candidates, M);
-				// connect the pruned set of candidates, including any self-loops:
+				// connect the pruned set of candidates, which may leave some slots unused
 				int j = 0; 
 				while( candidates.size() > 0){ // candidates
 					neighbor_node_links[j] = candidates.top().second;
 					candidates.pop();
 					j++;
 				}
-				while( j < M ){ // self-loops (unused links)
-					neighbor_node_links[j] = neighbor_node_id;
-					j++;
-				}
+				*neighbor_node_degree = j;
 			}
 			// loop increments:
 			i++;
 			if (i >= M){i = M;}
 			neighbors.pop();
 		}
+		*(nodeDegree(new_node_id)) = i;
 
+	}
 
+	template <bool collect_stats = false>
+	node_id_t searchInitialization(const void* query, int n_initializations, SearchStats* stats = NULL){
+		if (!upper_layers.empty()){
+			return descendHierarchy<collect_stats>(query, 0, stats);
+		}
+		if (!router_nodes.empty()){
+			return routerInitialization<collect_stats>(query, stats);
+		}
+		return stridedInitialization<collect_stats>(query, 0, cur_num_nodes, n_initializations, stats);
 	}
 
-	node_id_t searchInitialization(const void* query, int n_initializations){
-		// select entry_node from a set of random entry point options
-		int step_size = cur_num_nodes / n_initializations;
-		if (step_size <= 0){ step_size = 1; }
+	template <bool collect_stats = false>
+	node_id_t stridedInitialization(const void* query, node_id_t begin, node_id_t end, int n_initializations,
+		SearchStats* stats = NULL){
+		// select entry_node from a set of random entry point options in [begin, end)
+		size_t step_size = ((size_t)(end) - begin) / n_initializations;
+		if (step_size == 0){ step_size = 1; }
 
 		dist_t min_dist = std::numeric_limits<dist_t>::max();
-		node_id_t entry_node = 0;
-
-		for( node_id_t node = 0; node < cur_num_nodes; node += step_size){
-			dist_t dist = distance(query, nodeData(node), distance_param);
-			if (dist < min_dist){
-				min_dist = dist; 
-				entry_node = node;
+		node_id_t entry_node = begin;
+
+		// the candidates are evaluated in batches of up to 16
+		const void* batch_data[16];
+		dist_t batch_distances[16];
+		for( size_t node = begin; node < end; ){ // size_t, since node_id_t could overflow
+			size_t n = 0;
+			for (size_t batch_node = node; n < 16 && batch_node < end; batch_node += step_size){
+				batch_data[n++] = nodeData(batch_node);
+			}
+			queryDistanceBatch(query, batch_data, n, batch_distances);
+			if (collect_stats){ stats->distance_computations += n; }
+			for (size_t i = 0; i < n; i++, node += step_size){
+				if (batch_distances[i] < min_dist){
+					min_dist = batch_distances[i]; 
+					entry_node = node;
+				}
 			}
 		}
 		return entry_node;
 	}
 
+	template <bool collect_stats = false>
+	node_id_t routerInitialization(const void* query, SearchStats* stats = NULL){
+		// the router vectors are contiguous, so this is a sequential scan rather than one cache miss per candidate
+		dist_t min_dist = std::numeric_limits<dist_t>::max();
+		size_t best = 0;
+		const char* entry_data = router_data.data();
+		const void* batch_data[16];
+		dist_t batch_distances[16];
+		for (size_t i = 0; i < router_nodes.size(); i += 16){
+			size_t n = std::min<size_t>(16, router_nodes.size() - i);
+			for (size_t j = 0; j < n; j++){
+				batch_data[j] = entry_data + (i + j)*data_size_bytes;
+			}
+			queryDistanceBatch(query, batch_data, n, batch_distances);
+			for (size_t j = 0; j < n; j++){
+				if (batch_distances[j] < min_dist){
+					min_dist = batch_distances[j];
+					best = i + j;
+				}
+			}
+		}
+		if (collect_stats){ stats->distance_computations += router_nodes.size(); }
+		return router_nodes[best];
+	}
+
+	node_id_t* upperLinks(UpperLayer& layer, node_id_t node){
+		return layer.links.data() + layer.position.at(node)*upper_M;
+	}
+
+	// Greedy search from the top layer down to (and including) layer "stop_layer" + 1. Returns the closest node found in that layer.
+	template <bool collect_stats = false>
+	node_id_t descendHierarchy(const void* query, size_t stop_layer, SearchStats* stats = NULL){
+		node_id_t current = hierarchy_entry;
+		dist_t current_dist = queryDistance(query, nodeData(current));
+		if (collect_stats){ stats->distance_computations++; }
+		for (size_t l = upper_layers.size(); l > stop_layer; l--){
+			UpperLayer& layer = upper_layers[l-1];
+			bool improved = true;
+			while (improved){
+				improved = false;
+				node_id_t* links = upperLinks(layer, current);
+				for (size_t i = 0; i < upper_M; i++){
+					if (links[i] == current){ continue; }
+					dist_t dist = queryDistance(query, nodeData(links[i]));
+					if (collect_stats){ stats->distance_computations++; }
+					if (dist < current_dist){
+						current_dist = dist;
+						current = links[i];
+						improved = true;
+					}
+				}
+			}
+		}
+		return current;
+	}
+
+	// Beam search within one upper layer. Returns a max-heap of (distance, node) with up to buffer_size nodes.
+	PriorityQueue upperBeamSearch(const void* query, node_id_t entry_node, UpperLayer& layer, int buffer_size){
+		PriorityQueue neighbors;
+		PriorityQueue candidates;
+		std::unordered_set<node_id_t> visited;
+		dist_t dist = queryDistance(query, nodeData(entry_node));
+		neighbors.emplace(dist, entry_node);
+		candidates.emplace(-dist, entry_node);
+		visited.insert(entry_node);
+		while (!candidates.empty()){
+			dist_node_t d_node = candidates.top();
+			if ((-d_node.first) > neighbors.top().first && neighbors.size() >= buffer_size){ break; }
+			candidates.pop();
+			node_id_t* links = upperLinks(layer, d_node.second);
+			for (size_t i = 0; i < upper_M; i++){
+				if (!visited.insert(links[i]).second){ continue; }
+				dist = queryDistance(query, nodeData(links[i]));
+				if (neighbors.size() < buffer_size || dist < neighbors.top().first){
+					candidates.emplace(-dist, links[i]);
+					neighbors.emplace(dist, links[i]);
+					if (neighbors.size() > buffer_size){ neighbors.pop(); }
+				}
+			}
+		}
+		return neighbors;
+	}
+
+	// Adds a link from "node" to "neighbor" in an upper layer. If node already has upper_M links, the new
+	// link competes with the existing ones and the HNSW heuristic picks which ones to keep.
+	void addUpperLink(UpperLayer& layer, node_id_t node, node_id_t neighbor){
+		node_id_t* links = upperLinks(layer, node);
+		for (size_t i = 0; i < upper_M; i++){
+			if (links[i] == neighbor){ return; }
+			if (links[i] == node){
+				links[i] = neighbor;
+				return;
+			}
+		}
+		PriorityQueue candidates;
+		candidates.emplace(distance(nodeData(node), nodeData(neighbor), distance_param), neighbor);
+		for (size_t i = 0; i < upper_M; i++){
+			candidates.emplace(distance(nodeData(node), nodeData(links[i]), distance_param), links[i]);
+		}
+		selectNeighbors(candidates, upper_M);
+		for (size_t i = 0; i < upper_M; i++){
+			links[i] = node;
+		}
+		for (size_t i = 0; !candidates.empty(); i++){
+			links[i] = candidates.top().second;
+			candidates.pop();
+		}
+	}
+
+	// Inserts a node into a random number of upper layers (none, most of the time).
+	void insertIntoHierarchy(node_id_t node, int ef_construction){
+		double level_multiplier = 1.0 / std::log((double)(upper_M));
+		double uniform = std::uniform_real_distribution<double>(0.0, 1.0)(level_generator);
+		size_t level = (size_t)(-std::log(std::max(uniform, 1e-12)) * level_multiplier);
+		level = std::min<size_t>(level, 16);
+		if (level == 0){ return; }
+
+		std::vector<char> context;
+		const void* data = prepareQuery(nodeData(node), context);
+		if (!upper_layers.empty()){
+			node_id_t entry_node = descendHierarchy(data, level);
+			for (size_t l = std::min(level, upper_layers.size()); l > 0; l--){
+				UpperLayer& layer = upper_layers[l-1];
+				PriorityQueue neighbors = upperBeamSearch(data, entry_node, layer, ef_construction);
+				// the closest node is the entry point for the next layer down
+				PriorityQueue closest = neighbors;
+				while (closest.size() > 1){ closest.pop(); }
+				entry_node = closest.top().second;
+
+				selectNeighbors(neighbors, upper_M);
+				layer.position[node] = layer.nodes.size();
+				layer.nodes.push_back(node);
+				layer.links.resize(layer.links.size() + upper_M, node);
+				while (!neighbors.empty()){
+					addUpperLink(layer, node, neighbors.top().second);
+					addUpperLink(layer, neighbors.top().second, node);
+					neighbors.pop();
+				}
+			}
+		}
+		// new layers on top of the hierarchy only contain this node
+		if (level > upper_layers.size()){
+			while (upper_layers.size() < level){
+				upper_layers.emplace_back();
+				UpperLayer& layer = upper_layers.back();
+				layer.position[node] = 0;
+				layer.nodes.push_back(node);
+				layer.links.resize(upper_M, node);
+			}
+			hierarchy_entry = node;
+		}
+	}
+
 	inline void swap(node_id_t a, node_id_t b, void* temp_data, node_id_t* temp_links, label_t* temp_label){
+		// temp_links holds the degree and the M links
 		// stash b in temp
 		std::memcpy(temp_data, nodeData(b), data_size_bytes);
-		std::memcpy(temp_links, nodeLinks(b), M*sizeof(node_id_t));
+		std::memcpy(temp_links, nodeDegree(b), (M+1)*sizeof(node_id_t));
 		std::memcpy(temp_label, nodeLabel(b), sizeof(label_t));
 
 		// place node at a in b
 		std::memcpy(nodeData(b), nodeData(a), data_size_bytes);
-		std::memcpy(nodeLinks(b), nodeLinks(a), M*sizeof(node_id_t));
+		std::memcpy(nodeDegree(b), nodeDegree(a), (M+1)*sizeof(node_id_t));
 		std::memcpy(nodeLabel(b), nodeLabel(a), sizeof(label_t));
 
 		// put node b in a
 		std::memcpy(nodeData(a), temp_data, data_size_bytes);
-		std::memcpy(nodeLinks(a), temp_links, M*sizeof(node_id_t));
+		std::memcpy(nodeDegree(a), temp_links, (M+1)*sizeof(node_id_t));
 		std::memcpy(nodeLabel(a), temp_label, sizeof(label_t));
 
 		return; 
 	}
 
-	void old_relabel(const std::vector<node_id_t>& P){
-
-		char* new_partition = new char[node_size_bytes * max_num_nodes];
-		char* old_partition = index_memory;
-
-		for (node_id_t old_node = 0; old_node < cur_num_nodes; old_node++){
-			index_memory = old_partition;
-			void* old_node_data_p = nodeData(old_node);
-			node_id_t* old_node_links = nodeLinks(old_node);
-			label_t* old_node_label = nodeLabel(old_node);
-
-			index_memory = new_partition;
-			void* new_node_data_p = nodeData(P[old_node]); 
-			std::memcpy(new_node_data_p, old_node_data_p, data_size_bytes);
-
-			node_id_t* new_node_links = nodeLinks(P[old_node]);
-			for (int i = 0; i < M; i++){
-				new_node_links[i] = P[old_node_links[i]];
+	void relabel(const std::vector<node_id_t>& P){
+		for (node_id_t& node : router_nodes){
+			node = P[node];
+		}
+		for (UpperLayer& layer : upper_layers){
+			layer.position.clear();
+			for (size_t i = 0; i < layer.nodes.size(); i++){
+				layer.nodes[i] = P[layer.nodes[i]];
+				layer.position[layer.nodes[i]] = i;
+			}
+			for (node_id_t& link : layer.links){
+				link = P[link];
 			}
-
-			label_t* new_node_label = nodeLabel(P[old_node]);
-			*(new_node_label) = *(old_node_label);
 		}
-		// copy old address into new one
-		std::memcpy(old_partition, new_partition, node_size_bytes*max_num_nodes);
-		// reassign data_partition to be correct
-		index_memory = old_partition;
-		// free the temporary partition
-		delete[] new_partition;
-	}
-
-
+		if (!upper_layers.empty()){ hierarchy_entry = P[hierarchy_entry]; }
 
-	void relabel(const std::vector<node_id_t>& P){
 		// 1. Rewire all of the node connections
 		for (node_id_t n = 0; n < cur_num_nodes; n++){
 			node_id_t *links = nodeLinks(n);
-			for (int m = 0; m < M; m++){
+			int degree = *(nodeDegree(n));
+			for (int m = 0; m < degree; m++){
 				links[m] = P[links[m]];
 			}
 		}
 
 		// 2. Physically re-layout the nodes (in place)
 		char* temp_data = new char[data_size_bytes];
-		node_id_t* temp_links = new node_id_t[M];
+		node_id_t* temp_links = new node_id_t[M+1];
 		label_t* temp_label = new label_t;
 
 		is_visited.clear(); // a better name in this context would be "is_relocated" (I just didn't want another VisitedList)
@@ -369,49 +1011,273 @@ private:
 		delete temp_label;
 	}
 
+	void grow(size_t new_max_num_nodes){
+		// moves the nodes to a larger arena (which also copies a memory-mapped index into memory)
+		char* new_memory = new char[node_size_bytes * new_max_num_nodes];
+		std::memcpy(new_memory, index_memory, node_size_bytes * cur_num_nodes);
+		freeIndexMemory();
+		index_memory = new_memory;
+		max_num_nodes = new_max_num_nodes;
+		is_visited = VisitedSet(max_num_nodes+1);
+		visited_pool.resize(max_num_nodes+1);
+	}
+
+	void freeIndexMemory(){
+#if defined(__unix__) || defined(__APPLE__)
+		if (mapped_file != NULL){
+			munmap(mapped_file, mapped_size);
+			mapped_file = NULL;
+			mapped_size = 0;
+			index_memory = NULL;
+		}
+#endif
+		delete[] index_memory;
+		index_memory = NULL;
+	}
+
 public:
 
 	// N is the max number of nodes. M is the max number of edges. Space provides info about data size and distance function
-	Index(SpaceInterface<dist_t> *space, int _N, int _M): 
-		max_num_nodes(_N), cur_num_nodes(0), M(_M), is_visited(_N+1) {
+	Index(SpaceInterface<dist_t> *space, size_t _N, int _M): 
+		max_num_nodes(_N), cur_num_nodes(0), M(_M), mapped_file(NULL), mapped_size(0),
+		is_visited(_N+1), visited_pool(_N+1), query_cache(NULL), upper_M(0), level_generator(100) {
 
-		distance_param = space->get_dist_func_param();
-		distance = space->get_dist_func();
+		if (_N > std::numeric_limits<node_id_t>::max()){
+			throw std::invalid_argument("Index capacity is too large for node_id_t");
+		}
+		if (_M > MAX_M){
+			throw std::invalid_argument("M is larger than Index::MAX_M");
+		}
+		setSpace(space);
 		data_size_bytes = space->get_data_size();
-		node_size_bytes = space->get_data_size() + sizeof(node_id_t)*M + sizeof(label_t);
+		node_size_bytes = space->get_data_size() + sizeof(node_id_t)*(M+1) + sizeof(label_t);
 		size_t index_memory_size = node_size_bytes*max_num_nodes;
 		index_memory = new char[index_memory_size];		
 	}
 
 	// TODO: change to use a stream rather than string filename for IO
-	Index(SpaceInterface<dist_t> *space, std::string& filename):
-    	max_num_nodes(0), cur_num_nodes(0), index_memory(NULL) {
-		load(filename, space);
+	Index(SpaceInterface<dist_t> *space, std::string& filename, bool use_mmap = false):
+    	max_num_nodes(0), cur_num_nodes(0), index_memory(NULL), mapped_file(NULL), mapped_size(0), query_cache(NULL),
+		upper_M(0), level_generator(100) {
+		load(filename, space, use_mmap);
 	}
 
 	~Index(){
-		delete[] index_memory;
+		freeIndexMemory();
+		delete query_cache;
 	}
 
 	bool add(void* data, label_t& label, int ef_construction, int n_initializations = 100){
+		decompress_links();
 		// initialization must happen before alloc due to a stupid bug where searchInitialization chooses new_node_id as the initialization
 		// since new_node_id has distance 0 (but no links), this bug literally skips the search
 		node_id_t new_node_id;
-		node_id_t entry_node = searchInitialization(data, n_initializations);
+		std::vector<char> context;
+		const void* query = prepareQuery(data, context);
+		node_id_t entry_node = searchInitialization(query, n_initializations);
 		// make space for the new node
 		if (!allocateNode(data,label,new_node_id)){return false;}
+		if (query_cache != NULL){ query_cache->clear(); } // cached results may be missing the new node
+		if (upper_M > 0){ insertIntoHierarchy(new_node_id, ef_construction); }
 		// search graph for neighbors of new node, connect to them
 		if (new_node_id > 0){
-			PriorityQueue neighbors = beamSearch(data, entry_node, ef_construction);
+			PriorityQueue neighbors = beamSearch(query, entry_node, ef_construction, is_visited);
 			selectNeighbors(neighbors, M);
 			connectNeighbors(neighbors, new_node_id);
 		} else {return false;}
 		return true;
 	}
 
-	std::vector< dist_label_t > search(const void* query, const int K, int ef_search, int n_initializations = 100){
-		node_id_t entry_node = searchInitialization(query, n_initializations);
-		PriorityQueue neighbors = beamSearch(query, entry_node, ef_search);
+	// Builds the graph for n points at once, instead of n calls to add(). The points are stored contiguously
+	// in "data". First, we build an approximate knn-nearest neighbor graph with NN-descent (knn defaults to 2*M).
+	// Then we apply the same selectNeighbors heuristic as add() to each node's neighbors, add reverse edges
+	// (pruning again wherever a node would exceed M links) and link any unreachable components. The knn lists
+	// alone only give short links: on clustered data, that leaves almost no edges between clusters, and recall
+	// suffers no matter where the search starts. add() gets its long links from the nodes inserted while the
+	// graph was small. Here, as in NSG and Vamana, each node also considers M random nodes before pruning.
+	// All but the last step run on num_threads threads. On one core, this is about 3-4x slower than add()
+	// (e.g. 3s vs 0.8s for 20k 32-d points with M=16), so it only pays off with several cores.
+	// The index must be empty. Returns false if it is not, or if n exceeds the capacity of the index.
+	bool bulk_build(const void* data, const label_t* labels, size_t n, int ef_construction = 100, int num_threads = 0,
+		int knn = 0, int iterations = 10){
+		if (cur_num_nodes != 0 || n > max_num_nodes){ return false; }
+		decompress_links();
+		if (knn <= 0){ knn = 2*M; }
+
+		parallel_for(0, n, num_threads, [&](size_t node, int thread_id){
+			std::memcpy(nodeData(node), reinterpret_cast<const char*>(data) + node*data_size_bytes, data_size_bytes);
+			*(nodeLabel(node)) = labels[node];
+			*(nodeDegree(node)) = 0;
+		});
+		cur_num_nodes = n;
+		if (n <= 1){ return true; }
+
+		std::vector< std::vector<dist_node_t> > knn_graph = nn_descent<dist_t, node_id_t>(n, knn,
+			[this](node_id_t a, node_id_t b){ return distance(nodeData(a), nodeData(b), distance_param); },
+			iterations, 0.5, 0.001, num_threads);
+
+		// prune each node's knn list, as add() does with its beam search results
+		parallel_for(0, n, num_threads, [&](size_t node, int thread_id){
+			PriorityQueue neighbors;
+			for (const dist_node_t& neighbor : knn_graph[node]){
+				neighbors.push(neighbor);
+			}
+			// plus M random nodes, the only candidates that can give long-range links (see above)
+			std::mt19937 rng(node);
+			std::uniform_int_distribution<size_t> pick(0, n - 1);
+			for (int i = 0; i < M; i++){
+				node_id_t other = pick(rng);
+				if (other != node){ neighbors.emplace(distance(nodeData(node), nodeData(other), distance_param), other); }
+			}
+			selectNeighbors(neighbors, M);
+			node_id_t* links = nodeLinks(node);
+			int degree = 0;
+			for (; !neighbors.empty() && degree < M; degree++){
+				links[degree] = neighbors.top().second;
+				neighbors.pop();
+			}
+			*(nodeDegree(node)) = degree;
+		});
+		knn_graph.clear();
+
+		addReverseEdges(num_threads);
+		connectComponents(ef_construction);
+
+		if (upper_M > 0){
+			for (node_id_t node = 0; node < n; node++){
+				insertIntoHierarchy(node, ef_construction);
+			}
+		}
+		if (query_cache != NULL){ query_cache->clear(); }
+		return true;
+	}
+
+	// Improves the links of every node in place. Each node searches for its own neighbors in the current graph
+	// (with ef_construction), and its links are replaced by the pruned (selectNeighbors) union of the search results
+	// and its current links. Nodes inserted early by add() were connected when the graph was tiny, so their links
+	// change the most. Each iteration computes the new links of all nodes in parallel against the current graph
+	// and only then writes them back, so the searches never see a half-updated graph. n_initializations is used
+	// as in add() to pick the entry node of each node's search.
+	void refine(int iterations = 1, int ef_construction = 100, int num_threads = 0, int n_initializations = 100){
+		decompress_links();
+		if (cur_num_nodes <= 1){ return; }
+		std::vector<node_id_t> new_links(cur_num_nodes * M);
+		std::vector<int> new_degrees(cur_num_nodes);
+		for (int iteration = 0; iteration < iterations; iteration++){
+			parallel_for(0, cur_num_nodes, num_threads, [&](size_t node, int thread_id){
+				std::vector<char> context;
+				node_id_t entry_node = searchInitialization(prepareQuery(nodeData(node), context), n_initializations);
+				new_degrees[node] = relinkNode(node, entry_node, ef_construction, &new_links[node * M]);
+			});
+			for (node_id_t node = 0; node < cur_num_nodes; node++){
+				setLinks(node, &new_links[node * M], new_degrees[node]);
+			}
+			addReverseEdges(num_threads);
+			connectComponents(ef_construction);
+		}
+		if (query_cache != NULL){ query_cache->clear(); }
+	}
+
+	// Adds all of the nodes of "other" to this index, without inserting them one at a time. The two indexes must
+	// use the same space and M. other's nodes are appended (with their IDs shifted by size()) and keep their links,
+	// so at first the two graphs are disjoint. Then every node of the smaller graph searches the larger one with
+	// ef_construction, and its links are re-pruned from the results and its current links, as in refine().
+	// Reverse edges connect the nodes it finds back to it. This costs one search per node of the smaller graph
+	// (e.g. a daily delta), instead of one insertion per node of both. The index grows if it is too small.
+	// other's router and hierarchy are not copied, and our router only points into our old nodes, so call
+	// build_router again to include the new ones. label_offset is added to the labels of other's nodes.
+	// other may have compressed links (see compress_links): they are decoded into this index, and other is unchanged.
+	// Returns false if the indexes are not compatible, or if the merged index would not fit in node_id_t.
+	bool merge(const Index& other, int ef_construction = 100, int num_threads = 0, label_t label_offset = 0){
+		if (other.M != M || other.data_size_bytes != data_size_bytes){ return false; }
+		decompress_links();
+		if (other.cur_num_nodes == 0){ return true; }
+		node_id_t offset = cur_num_nodes;
+		size_t total = cur_num_nodes + other.cur_num_nodes;
+		if (total > std::numeric_limits<node_id_t>::max()){ return false; } // too many nodes for node_id_t
+		if (total > max_num_nodes){ grow(total); }
+
+		if (other.compressed_offsets.empty()){
+			std::memcpy(index_memory + offset * node_size_bytes, other.index_memory, other.cur_num_nodes * node_size_bytes);
+		} else {
+			// other's records are [data][label] and its links are in compressed_links, so copy them one at a time
+			parallel_for(0, other.cur_num_nodes, num_threads, [&](size_t node, int thread_id){
+				const char* record = other.index_memory + node * other.node_size_bytes;
+				std::memcpy(nodeData(offset + node), record, data_size_bytes);
+				std::memcpy(nodeLabel(offset + node), record + other.node_size_bytes - sizeof(label_t), sizeof(label_t));
+				*(nodeDegree(offset + node)) = other.decodeLinks(node, nodeLinks(offset + node));
+			});
+		}
+		parallel_for(offset, total, num_threads, [&](size_t node, int thread_id){
+			node_id_t* links = nodeLinks(node);
+			int degree = *(nodeDegree(node));
+			for (int i = 0; i < degree; i++){
+				links[i] += offset;
+			}
+			*(nodeLabel(node)) += label_offset;
+		});
+		cur_num_nodes = total;
+		if (query_cache != NULL){ query_cache->clear(); }
+
+		if (offset > 0){
+			// since the graphs are disjoint, a search that starts in the larger graph stays in it
+			bool other_is_smaller = (total - offset) <= offset;
+			node_id_t small_begin = other_is_smaller ? offset : 0;
+			node_id_t small_end = other_is_smaller ? total : offset;
+			node_id_t large_begin = other_is_smaller ? 0 : offset;
+			node_id_t large_end = other_is_smaller ? offset : total;
+
+			std::vector<node_id_t> new_links((small_end - small_begin) * M);
+			std::vector<int> new_degrees(small_end - small_begin);
+			parallel_for(small_begin, small_end, num_threads, [&](size_t node, int thread_id){
+				std::vector<char> context;
+				node_id_t entry_node = stridedInitialization(prepareQuery(nodeData(node), context), large_begin, large_end, 100);
+				new_degrees[node - small_begin] = relinkNode(node, entry_node, ef_construction,
+					&new_links[(node - small_begin) * M]);
+			});
+			for (node_id_t node = small_begin; node < small_end; node++){
+				setLinks(node, &new_links[(node - small_begin) * M], new_degrees[node - small_begin]);
+			}
+			addReverseEdges(num_threads, small_begin, small_end);
+			connectComponents(ef_construction);
+		}
+
+		if (upper_M > 0){
+			for (node_id_t node = offset; node < total; node++){
+				insertIntoHierarchy(node, ef_construction);
+			}
+		}
+		return true;
+	}
+
+	std::vector< dist_label_t > search(const void* query, const int K, int ef_search, int n_initializations = 100,
+		const EarlyTermination& termination = EarlyTermination(), SearchStats* stats = NULL){
+		// Searches that collect stats always run (and are not cached), so that the stats describe a real search.
+		std::string cache_key;
+		if (query_cache != NULL && stats == NULL){
+			CacheKeyParams params = {K, ef_search, n_initializations, termination.patience, termination.min_improvement};
+			cache_key = query_cache->key(query, params);
+			std::vector<dist_label_t> cached;
+			if (query_cache->get(cache_key, cached)){ return cached; }
+		}
+
+		node_id_t entry_node;
+		PriorityQueue neighbors;
+		std::vector<char> context;
+		const void* prepared_query = prepareQuery(query, context);
+		VisitedSet* visited = visited_pool.acquire();
+		if (stats == NULL){
+			entry_node = searchInitialization(prepared_query, n_initializations);
+			neighbors = beamSearch(prepared_query, entry_node, ef_search, *visited, K, &termination);
+		} else {
+			*stats = SearchStats();
+			auto start = std::chrono::high_resolution_clock::now();
+			entry_node = searchInitialization<true>(prepared_query, n_initializations, stats);
+			auto stop = std::chrono::high_resolution_clock::now();
+			stats->initialization_ns = std::chrono::duration<double, std::nano>(stop - start).count();
+			neighbors = beamSearch<true>(prepared_query, entry_node, ef_search, *visited, K, &termination, stats);
+		}
+		visited_pool.release(visited);
 		std::vector<dist_label_t> results;
 		while(neighbors.size() > K){
 			neighbors.pop();
@@ -422,6 +1288,265 @@ public:
 		}
 		std::sort( results.begin(), results.end(), [](const dist_label_t& left, const dist_label_t& right)
 			{ return left.first < right.first; });
+		if (!cache_key.empty()){ query_cache->put(cache_key, results); }
+		return results;
+	}
+
+	// Puts a cache of up to "capacity" search results in front of search(). If epsilon > 0, queries that are
+	// within epsilon of each other in every coordinate may share results (see QueryCache.h). epsilon > 0 requires
+	// float data (dist_t float, data a whole number of floats) and throws std::invalid_argument otherwise.
+	// The cache is emptied by every method that changes the graph or the entry points (add, reorder, build_router...).
+	// Must not be called while other threads are searching.
+	void enable_query_cache(size_t capacity, float epsilon = 0){
+		// epsilon > 0 rounds the query coordinates as floats (see QueryCache.h), which only makes sense for float data
+		if (epsilon > 0 && !(std::is_same<dist_t, float>::value && data_size_bytes % sizeof(float) == 0)){
+			throw std::invalid_argument("Query cache epsilon requires float data");
+		}
+		delete query_cache;
+		query_cache = new QueryCache<dist_t, label_t>(capacity, data_size_bytes, epsilon);
+	}
+
+	void disable_query_cache(){
+		delete query_cache;
+		query_cache = NULL;
+	}
+
+	// NULL if the cache is disabled. Use it to read the hit and miss counters.
+	QueryCache<dist_t, label_t>* get_query_cache(){
+		return query_cache;
+	}
+
+	// Builds an entry point router with num_entries entry points, which replaces the strided scan in
+	// searchInitialization (n_initializations is then ignored). The entry points are found by k-medoids
+	// clustering of a sample of sample_size nodes (default: 16 per entry point), so every entry point is
+	// a graph node and the clustering only needs the distance function - we never need to know the data type.
+	// If the sample has fewer than num_entries distinct points, there are fewer entry points (see router_size).
+	// Must not be called while other threads are searching. Saved with the index.
+	void build_router(int num_entries, int sample_size = 0, int iterations = 5, int num_threads = 0){
+		router_nodes.clear();
+		router_data.clear();
+		if (query_cache != NULL){ query_cache->clear(); } // cached results came from the old entry points
+		if (num_entries <= 0 || cur_num_nodes == 0){ return; }
+		if (sample_size <= 0){ sample_size = 16*num_entries; }
+		sample_size = std::min<size_t>(sample_size, cur_num_nodes);
+		num_entries = std::min(num_entries, sample_size);
+
+		// uniform random sample of nodes
+		std::mt19937 rng(1234);
+		std::vector<node_id_t> sample(cur_num_nodes);
+		for (node_id_t n = 0; n < cur_num_nodes; n++){ sample[n] = n; }
+		for (int i = 0; i < sample_size; i++){
+			std::uniform_int_distribution<size_t> pick(i, cur_num_nodes - 1);
+			std::swap(sample[i], sample[pick(rng)]);
+		}
+		sample.resize(sample_size);
+
+		// k-means++ seeding: each new medoid is drawn with probability proportional to its distance from the closest one so far.
+		// Nodes that are already medoids, or duplicates of one (closest == 0), get no weight. If only those are left, we stop
+		// with fewer entries.
+		std::vector<int> medoids; // indices into sample
+		std::vector<dist_t> closest(sample_size, std::numeric_limits<dist_t>::max());
+		std::vector<bool> chosen(sample_size, false);
+		std::vector<double> weight(sample_size);
+		medoids.push_back(0);
+		chosen[0] = true;
+		while (medoids.size() < num_entries){
+			const void* latest = nodeData(sample[medoids.back()]);
+			double total = 0;
+			int last = -1; // last node with a positive weight, in case rounding leaves sum just below target
+			for (int i = 0; i < sample_size; i++){
+				closest[i] = std::min(closest[i], distance(nodeData(sample[i]), latest, distance_param));
+				weight[i] = chosen[i] ? 0 : std::max<double>(0, closest[i]);
+				if (weight[i] > 0){ last = i; }
+				total += weight[i];
+			}
+			if (last < 0){ break; }
+			double target = std::uniform_real_distribution<double>(0, total)(rng);
+			int next = last;
+			double sum = 0;
+			for (int i = 0; i < last; i++){
+				sum += weight[i];
+				if (weight[i] > 0 && sum >= target){
+					next = i;
+					break;
+				}
+			}
+			medoids.push_back(next);
+			chosen[next] = true;
+		}
+		num_entries = medoids.size();
+
+		// Voronoi iteration: assign each sample node to its closest medoid, then move each medoid to the
+		// member of its cluster with the smallest total distance to the other members
+		std::vector<int> assignment(sample_size);
+		for (int iteration = 0; iteration < iterations; iteration++){
+			parallel_for(0, sample_size, num_threads, [&](size_t i, int thread_id){
+				dist_t min_dist = std::numeric_limits<dist_t>::max();
+				for (int c = 0; c < num_entries; c++){
+					dist_t dist = distance(nodeData(sample[i]), nodeData(sample[medoids[c]]), distance_param);
+					if (dist < min_dist){
+						min_dist = dist;
+						assignment[i] = c;
+					}
+				}
+			});
+			std::vector< std::vector<int> > clusters(num_entries);
+			for (int i = 0; i < sample_size; i++){
+				clusters[assignment[i]].push_back(i);
+			}
+			parallel_for(0, num_entries, num_threads, [&](size_t c, int thread_id){
+				double best_cost = std::numeric_limits<double>::max();
+				for (int candidate : clusters[c]){
+					double cost = 0;
+					for (int member : clusters[c]){
+						cost += distance(nodeData(sample[candidate]), nodeData(sample[member]), distance_param);
+					}
+					if (cost < best_cost){
+						best_cost = cost;
+						medoids[c] = candidate;
+					}
+				}
+			});
+		}
+
+		router_nodes.resize(num_entries);
+		router_data.resize(num_entries*data_size_bytes);
+		for (int c = 0; c < num_entries; c++){
+			router_nodes[c] = sample[medoids[c]];
+			std::memcpy(router_data.data() + c*data_size_bytes, nodeData(router_nodes[c]), data_size_bytes);
+		}
+	}
+
+	size_t router_size(){
+		return router_nodes.size();
+	}
+
+	// Turns on the optional hierarchy of upper layers (HNSW-style), which then picks the entry node for every
+	// search and insert, taking precedence over the router and n_initializations. Nodes that are already in the
+	// index are inserted now, later nodes are inserted by add(). upper_M is the max degree in the upper layers
+	// and also sets how quickly they thin out (default M). Must not be called while other threads are searching.
+	void enable_hierarchy(int ef_construction = 100, int _upper_M = 0){
+		upper_M = (_upper_M > 1) ? _upper_M : std::max<size_t>(M, 2);
+		upper_layers.clear();
+		for (node_id_t node = 0; node < cur_num_nodes; node++){
+			insertIntoHierarchy(node, ef_construction);
+		}
+		if (query_cache != NULL){ query_cache->clear(); } // cached results came from the old entry points
+	}
+
+	void disable_hierarchy(){
+		upper_layers.clear();
+		upper_M = 0;
+		if (query_cache != NULL){ query_cache->clear(); }
+	}
+
+	// Number of upper layers (0 if the hierarchy is disabled or still empty).
+	size_t hierarchy_levels(){
+		return upper_layers.size();
+	}
+
+	// Switches the index to a read-only compressed form of the links. Each node's links (without the unused
+	// slots) are sorted and stored as varint-coded differences: the first link relative to the node and every
+	// other link relative to the previous one. After reordering (e.g. GORDER or RCM), most neighbors have IDs
+	// close to the node's own, so most differences fit in one byte instead of sizeof(node_id_t). The links are
+	// moved out of the node records, so the arena shrinks as well. beamSearch decodes the links of each node it
+	// expands. Anything that changes the graph (add, reorder, refine, merge...) first calls decompress_links.
+	// Saving writes the usual uncompressed format. Must not be called while other threads are searching.
+	void compress_links(){
+		if (!compressed_offsets.empty()){ return; }
+		if (query_cache != NULL){ query_cache->clear(); } // sorting the links changes the order in which search visits them
+		compressed_offsets.resize(cur_num_nodes + 1);
+		compressed_block_offsets.assign(cur_num_nodes / COMPRESSED_BLOCK + 1, 0);
+		compressed_links.clear();
+		std::vector<node_id_t> links;
+		for (node_id_t node = 0; node < cur_num_nodes; node++){
+			if (node % COMPRESSED_BLOCK == 0){
+				compressed_block_offsets[node / COMPRESSED_BLOCK] = compressed_links.size();
+			}
+			compressed_offsets[node] = compressed_links.size() - compressed_block_offsets[node / COMPRESSED_BLOCK];
+			node_id_t* node_links = nodeLinks(node);
+			links.assign(node_links, node_links + *(nodeDegree(node)));
+			std::sort(links.begin(), links.end());
+			links.erase(std::unique(links.begin(), links.end()), links.end());
+			for (size_t i = 0; i < links.size(); i++){
+				uint64_t value;
+				if (i == 0){
+					int64_t delta = (int64_t)(links[0]) - (int64_t)(node);
+					value = ((uint64_t)(delta) << 1) ^ (uint64_t)(delta >> 63);
+				} else {
+					value = links[i] - links[i-1];
+				}
+				while (value >= 0x80){
+					compressed_links.push_back((uint8_t)(value | 0x80));
+					value >>= 7;
+				}
+				compressed_links.push_back((uint8_t)(value));
+			}
+		}
+		if (cur_num_nodes % COMPRESSED_BLOCK == 0){
+			compressed_block_offsets[cur_num_nodes / COMPRESSED_BLOCK] = compressed_links.size();
+		}
+		compressed_offsets[cur_num_nodes] = compressed_links.size() - compressed_block_offsets[cur_num_nodes / COMPRESSED_BLOCK];
+		compressed_links.shrink_to_fit();
+
+		// move the data and labels into a smaller arena without the links
+		size_t compact_size_bytes = data_size_bytes + sizeof(label_t);
+		char* compact_memory = new char[compact_size_bytes * max_num_nodes];
+		for (node_id_t node = 0; node < cur_num_nodes; node++){
+			std::memcpy(compact_memory + node * compact_size_bytes, nodeData(node), data_size_bytes);
+			std::memcpy(compact_memory + node * compact_size_bytes + data_size_bytes, nodeLabel(node), sizeof(label_t));
+		}
+		freeIndexMemory();
+		index_memory = compact_memory;
+		node_size_bytes = compact_size_bytes;
+	}
+
+	// Undoes compress_links. Does nothing if the links are not compressed.
+	void decompress_links(){
+		if (compressed_offsets.empty()){ return; }
+		size_t full_size_bytes = data_size_bytes + sizeof(node_id_t)*(M+1) + sizeof(label_t);
+		char* full_memory = new char[full_size_bytes * max_num_nodes];
+		for (node_id_t node = 0; node < cur_num_nodes; node++){
+			char* record = full_memory + node * full_size_bytes;
+			std::memcpy(record, nodeData(node), data_size_bytes);
+			std::memcpy(record + full_size_bytes - sizeof(label_t), nodeLabel(node), sizeof(label_t));
+			node_id_t* degree = reinterpret_cast<node_id_t*>(record + data_size_bytes);
+			*degree = decodeLinks(node, degree + 1);
+		}
+		freeIndexMemory();
+		index_memory = full_memory;
+		node_size_bytes = full_size_bytes;
+		std::vector<uint8_t>().swap(compressed_links);
+		std::vector<uint32_t>().swap(compressed_offsets);
+		std::vector<uint64_t>().swap(compressed_block_offsets);
+	}
+
+	// Bytes used by the links of all nodes, compressed or not.
+	size_t link_memory_bytes(){
+		if (compressed_offsets.empty()){
+			return cur_num_nodes * (M+1) * sizeof(node_id_t);
+		}
+		return compressed_links.size() + compressed_offsets.size() * sizeof(uint32_t) +
+			compressed_block_offsets.size() * sizeof(uint64_t);
+	}
+
+	std::vector< dist_label_t > range_search(const void* query, const dist_t radius, int ef_search, int n_initializations = 100){
+		// returns all of the (approximate) neighbors within distance "radius" of the query, sorted by distance.
+		// ef_search only controls the breadth of the search outside the radius - the number of results is unbounded.
+		std::vector<char> context;
+		query = prepareQuery(query, context);
+		node_id_t entry_node = searchInitialization(query, n_initializations);
+		VisitedSet* visited = visited_pool.acquire();
+		PriorityQueue neighbors = rangeBeamSearch(query, entry_node, radius, ef_search, *visited);
+		visited_pool.release(visited);
+		std::vector<dist_label_t> results;
+		while( neighbors.size() > 0 ){
+			if (neighbors.top().first <= radius){
+				results.emplace_back(neighbors.top().first, *nodeLabel(neighbors.top().second));
+			}
+			neighbors.pop();
+		}
+		std::reverse(results.begin(), results.end());
 		return results;
 	}
 
@@ -437,56 +1562,219 @@ public:
 		out.write(reinterpret_cast< char *>(&max_num_nodes), sizeof(size_t));
 		out.write(reinterpret_cast< char *>(&cur_num_nodes), sizeof(size_t));
 		out.write(reinterpret_cast< char *>(&data_size_bytes), sizeof(size_t));
-		out.write(reinterpret_cast< char *>(&node_size_bytes), sizeof(size_t));
+		size_t record_size_bytes = data_size_bytes + sizeof(node_id_t)*(M+1) + sizeof(label_t);
+		out.write(reinterpret_cast< char *>(&record_size_bytes), sizeof(size_t));
 		
 		// write the index partition
-		size_t index_memory_size = node_size_bytes*max_num_nodes;
-		out.write(reinterpret_cast< char *>(index_memory), index_memory_size);
+		if (compressed_offsets.empty()){
+			size_t index_memory_size = node_size_bytes*max_num_nodes;
+			out.write(reinterpret_cast< char *>(index_memory), index_memory_size);
+		} else {
+			// compressed links are written out in the usual layout, so the file format does not change
+			std::vector<char> record(record_size_bytes);
+			node_id_t* degree = reinterpret_cast<node_id_t*>(record.data() + data_size_bytes);
+			for (node_id_t node = 0; node < max_num_nodes; node++){
+				std::memcpy(record.data(), nodeData(node), data_size_bytes);
+				std::memcpy(record.data() + record_size_bytes - sizeof(label_t), nodeLabel(node), sizeof(label_t));
+				*degree = (node < cur_num_nodes) ? decodeLinks(node, degree + 1) : 0;
+				out.write(record.data(), record_size_bytes);
+			}
+		}
+
+		// optional trailer with the entry point router. Older files simply end after the index partition.
+		if (!router_nodes.empty()){
+			uint64_t magic = ROUTER_MAGIC;
+			size_t num_entries = router_nodes.size();
+			out.write(reinterpret_cast< char *>(&magic), sizeof(uint64_t));
+			out.write(reinterpret_cast< char *>(&num_entries), sizeof(size_t));
+			out.write(reinterpret_cast< char *>(router_nodes.data()), num_entries*sizeof(node_id_t));
+			out.write(router_data.data(), num_entries*data_size_bytes);
+		}
+		if (upper_M > 0){
+			uint64_t magic = HIERARCHY_MAGIC;
+			size_t num_layers = upper_layers.size();
+			out.write(reinterpret_cast< char *>(&magic), sizeof(uint64_t));
+			out.write(reinterpret_cast< char *>(&upper_M), sizeof(size_t));
+			out.write(reinterpret_cast< char *>(&num_layers), sizeof(size_t));
+			out.write(reinterpret_cast< char *>(&hierarchy_entry), sizeof(node_id_t));
+			for (UpperLayer& layer : upper_layers){
+				size_t num_nodes = layer.nodes.size();
+				out.write(reinterpret_cast< char *>(&num_nodes), sizeof(size_t));
+				out.write(reinterpret_cast< char *>(layer.nodes.data()), num_nodes*sizeof(node_id_t));
+				out.write(reinterpret_cast< char *>(layer.links.data()), num_nodes*upper_M*sizeof(node_id_t));
+			}
+		}
 		out.close();
 	}
 
-	void load(const std::string& location, SpaceInterface<dist_t> *space){
+	void load(const std::string& location, SpaceInterface<dist_t> *space, bool use_mmap = false){
+		// If use_mmap is true, the node arena is memory-mapped from the file instead of being read into memory,
+		// so the OS pages nodes in on demand and can share them between processes. The mapping is private: 
+		// add() and reorder() still work, but their changes are copy-on-write and never reach the file.
+		// Do not save() over the file while it is mapped. Only supported on POSIX systems - elsewhere, and for
+		// files with self-loop padding (see below), we fall back to reading the file.
 
+		setSpace(space);
 		std::ifstream in(location, std::ios::binary);
 		in.read(reinterpret_cast< char *>(&M), sizeof(size_t));
 		in.read(reinterpret_cast< char *>(&max_num_nodes), sizeof(size_t));
 		in.read(reinterpret_cast< char *>(&cur_num_nodes), sizeof(size_t));
 		in.read(reinterpret_cast< char *>(&data_size_bytes), sizeof(size_t));
 		in.read(reinterpret_cast< char *>(&node_size_bytes), sizeof(size_t));
-
-		if (index_memory != NULL){
-			delete[] index_memory;
-			index_memory = NULL;
+		// The file does not record the width of the node IDs, but the record size implies it. Files written before
+		// the records had a degree field pad the unused links with self-loops instead, and are converted as we read them.
+		size_t file_record_size_bytes = node_size_bytes;
+		node_size_bytes = data_size_bytes + (M+1)*sizeof(node_id_t) + sizeof(label_t);
+		bool padded_links = (file_record_size_bytes == data_size_bytes + M*sizeof(node_id_t) + sizeof(label_t));
+		if (file_record_size_bytes != node_size_bytes && !padded_links){
+			throw std::invalid_argument("Index file " + location + " was saved with a different node_id_t or label_t");
+		}
+		if (max_num_nodes > std::numeric_limits<node_id_t>::max()){
+			throw std::invalid_argument("Index file " + location + " has too many nodes for node_id_t");
+		}
+		if (M > MAX_M){
+			throw std::invalid_argument("Index file " + location + " has M larger than Index::MAX_M");
 		}
 
+		freeIndexMemory();
+		std::vector<uint8_t>().swap(compressed_links);
+		std::vector<uint32_t>().swap(compressed_offsets);
+		std::vector<uint64_t>().swap(compressed_block_offsets);
+
+		size_t header_size = 5*sizeof(size_t);
 		size_t index_memory_size = node_size_bytes*max_num_nodes;
-		index_memory = new char[index_memory_size];
-		in.read(reinterpret_cast< char *>(index_memory), index_memory_size);
+#if defined(__unix__) || defined(__APPLE__)
+		if (use_mmap && !padded_links){
+			int fd = open(location.c_str(), O_RDONLY);
+			struct stat file_info;
+			if (fd < 0 || fstat(fd, &file_info) != 0 || (size_t)(file_info.st_size) < header_size + index_memory_size){
+				if (fd >= 0){ close(fd); }
+				throw std::runtime_error("Unable to memory-map index file " + location);
+			}
+			mapped_size = header_size + index_memory_size;
+			mapped_file = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapped_file == MAP_FAILED){
+				mapped_file = NULL;
+				mapped_size = 0;
+				throw std::runtime_error("Unable to memory-map index file " + location);
+			}
+			index_memory = reinterpret_cast<char*>(mapped_file) + header_size;
+		}
+#endif
+		if (index_memory == NULL && padded_links){
+			index_memory = new char[index_memory_size];
+			std::vector<char> record(file_record_size_bytes);
+			const node_id_t* padded = reinterpret_cast<const node_id_t*>(record.data() + data_size_bytes);
+			for (node_id_t node = 0; node < max_num_nodes; node++){
+				in.read(record.data(), file_record_size_bytes);
+				std::memcpy(nodeData(node), record.data(), data_size_bytes);
+				std::memcpy(nodeLabel(node), record.data() + file_record_size_bytes - sizeof(label_t), sizeof(label_t));
+				node_id_t* links = nodeLinks(node);
+				int degree = 0;
+				for (int i = 0; i < M && node < cur_num_nodes; i++){
+					if (padded[i] != node){ links[degree++] = padded[i]; }
+				}
+				*(nodeDegree(node)) = degree;
+			}
+		} else if (index_memory == NULL){
+			index_memory = new char[index_memory_size];
+			in.read(reinterpret_cast< char *>(index_memory), index_memory_size);
+		}
+
+		// optional trailer sections, each starting with a magic number
+		router_nodes.clear();
+		router_data.clear();
+		upper_layers.clear();
+		upper_M = 0;
+		in.seekg(header_size + file_record_size_bytes*max_num_nodes);
+		uint64_t magic = 0;
+		while (in.read(reinterpret_cast< char *>(&magic), sizeof(uint64_t))){
+			if (magic == ROUTER_MAGIC){
+				size_t num_entries = 0;
+				in.read(reinterpret_cast< char *>(&num_entries), sizeof(size_t));
+				router_nodes.resize(num_entries);
+				router_data.resize(num_entries*data_size_bytes);
+				in.read(reinterpret_cast< char *>(router_nodes.data()), num_entries*sizeof(node_id_t));
+				in.read(router_data.data(), num_entries*data_size_bytes);
+			} else if (magic == HIERARCHY_MAGIC){
+				size_t num_layers = 0;
+				in.read(reinterpret_cast< char *>(&upper_M), sizeof(size_t));
+				in.read(reinterpret_cast< char *>(&num_layers), sizeof(size_t));
+				in.read(reinterpret_cast< char *>(&hierarchy_entry), sizeof(node_id_t));
+				upper_layers.resize(num_layers);
+				for (UpperLayer& layer : upper_layers){
+					size_t num_nodes = 0;
+					in.read(reinterpret_cast< char *>(&num_nodes), sizeof(size_t));
+					layer.nodes.resize(num_nodes);
+					layer.links.resize(num_nodes*upper_M);
+					in.read(reinterpret_cast< char *>(layer.nodes.data()), num_nodes*sizeof(node_id_t));
+					in.read(reinterpret_cast< char *>(layer.links.data()), num_nodes*upper_M*sizeof(node_id_t));
+					for (size_t i = 0; i < num_nodes; i++){
+						layer.position[layer.nodes[i]] = i;
+					}
+				}
+			} else {
+				break;
+			}
+		}
 
-		distance_param = space->get_dist_func_param(); 
-		distance = space->get_dist_func();
 		is_visited = VisitedSet(max_num_nodes+1);
+		visited_pool.resize(max_num_nodes+1);
+		if (query_cache != NULL){ query_cache->clear(); }
 		in.close();
 	}
 
+	// Whether every node can be reached from node 0. bulk_build, refine and merge link unreachable nodes back in
+	// (see connectComponents), but they give up if that keeps cutting off other nodes, so check this after them.
+	bool connected(){
+		if (cur_num_nodes == 0){ return true; }
+		std::vector<bool> reached(cur_num_nodes, false);
+		std::vector<node_id_t> stack(1, 0);
+		std::vector<node_id_t> decoded_links(M);
+		reached[0] = true;
+		size_t num_reached = 1;
+		while (!stack.empty()){
+			node_id_t node = stack.back();
+			stack.pop_back();
+			node_id_t* links = nodeLinks(node);
+			int degree = *(nodeDegree(node));
+			if (!compressed_offsets.empty()){
+				links = decoded_links.data();
+				degree = decodeLinks(node, links);
+			}
+			for (int i = 0; i < degree; i++){
+				if (!reached[links[i]]){
+					reached[links[i]] = true;
+					num_reached++;
+					stack.push_back(links[i]);
+				}
+			}
+		}
+		return num_reached == cur_num_nodes;
+	}
+
 	// I don't like this hack for sparsification but I will tolerate it
 	std::vector< std::vector<node_id_t> > graph(){
 		std::vector< std::vector<node_id_t> > outdegree_table(cur_num_nodes);
+		std::vector<node_id_t> decoded_links(M);
 		for (node_id_t node = 0; node < cur_num_nodes; node++){
 			node_id_t* links = nodeLinks(node);
-			for (int i = 0; i < M; i++){
-				if (links[i] != node){
-					outdegree_table[node].push_back(links[i]);
-				}
+			int degree = *(nodeDegree(node));
+			if (!compressed_offsets.empty()){
+				links = decoded_links.data();
+				degree = decodeLinks(node, links);
 			}
+			outdegree_table[node].assign(links, links + degree);
 		}
 		return outdegree_table;
 	}
-	int size(){
+	size_t size(){
 		return cur_num_nodes;
 	}
 
 	void flash(std::vector< std::vector<node_id_t> >& outdegree_table){
+		decompress_links();
 		if (outdegree_table.size() < cur_num_nodes){
 			return;
 		}
@@ -502,9 +1790,6 @@ public:
 				neighbors.pop();
 			}
 			// connect neighbors
-			for (int i = 0; i < M; i++){
-				links[i] = node;
-			}
 			int i = 0;
 			while (neighbors.size() > 0){
 				node_id_t neighbor_node_id = neighbors.top().second;
@@ -513,20 +1798,19 @@ public:
 				if (i >= M){i = M;}
 				neighbors.pop();
 			}
+			*(nodeDegree(node)) = i;
 		}
+		if (query_cache != NULL){ query_cache->clear(); }
 	}
 
 
 
 	void reorder(GraphOrder algorithm){
+		decompress_links();
 		std::vector< std::vector<node_id_t> > outdegree_table(cur_num_nodes);
 		for (node_id_t node = 0; node < cur_num_nodes; node++){
 			node_id_t* links = nodeLinks(node);
-			for (int i = 0; i < M; i++){
-				if (links[i] != node){
-					outdegree_table[node].push_back(links[i]);
-				}
-			}
+			outdegree_table[node].assign(links, links + *(nodeDegree(node)));
 		}
 		std::vector<node_id_t> P;
 		// List of algorithms (so far): GORDER, IN_DEG, OUT_DEG, RCM, HUB_SORT, HUB_CLUSTER, DBG, BCORDER
@@ -542,26 +1826,44 @@ public:
 			case GraphOrder::BCORDER     : P = bc_order<node_id_t>(outdegree_table, 5); break;
 		}
 		relabel(P);
+		if (query_cache != NULL){ query_cache->clear(); } // the relabeled graph can give different entry points and ties
 	}
 
 	void profile_reorder(void* queries, int n_queries,
-		int ef_search, ProfileOrder algorithm){
+		int ef_search, ProfileOrder algorithm, int num_threads = 1){
+		decompress_links();
+		// count edge traversals by link slot: edge_weights[node*M + i] is the number of times that the
+		// search traversed node -> nodeLinks(node)[i]. Every edge starts with a weight of 1.
+		// Profiling queries run in parallel. Each thread has its own N*M buffer of traversal counts (so memory
+		// grows with num_threads), and the buffers are summed at the end.
+		num_threads = std::min(resolve_num_threads(num_threads), std::max(n_queries, 1));
+		std::vector< std::vector<float> > thread_weights(num_threads);
+		for (int t = 0; t < num_threads; t++){
+			thread_weights[t].assign(cur_num_nodes * M, 0.0);
+		}
+		parallel_for(0, n_queries, num_threads, [&](size_t i, int thread_id){
+			char* q = (char*)(queries) + i*(data_size_bytes);
+			profile_search(q, ef_search, thread_weights[thread_id]);
+		});
+		std::vector<float> edge_weights(cur_num_nodes * M, 1.0);
+		for (int t = 0; t < num_threads; t++){
+			for (size_t e = 0; e < edge_weights.size(); e++){
+				edge_weights[e] += thread_weights[t][e];
+			}
+			std::vector<float>().swap(thread_weights[t]); // free as we go
+		}
+
 		// construct the weighted graph
 		std::vector< std::vector<node_id_t> > outdegree_table(cur_num_nodes);
 		std::vector< std::vector<float> > outdegree_weights(cur_num_nodes);
 		for (node_id_t node = 0; node < cur_num_nodes; node++){
 			node_id_t* links = nodeLinks(node);
-			for (int i = 0; i < M; i++){
-				if (links[i] != node){
-					outdegree_table[node].push_back(links[i]);
-					outdegree_weights[node].push_back(1.0);
-				}
+			int degree = *(nodeDegree(node));
+			for (int i = 0; i < degree; i++){
+				outdegree_table[node].push_back(links[i]);
+				outdegree_weights[node].push_back(edge_weights[node * M + i]);
 			}
 		}
-		for (int i = 0; i < n_queries; i++){
-			char* q = (char*)(queries) + i*(data_size_bytes);
-			profile_search(q, ef_search, outdegree_table, outdegree_weights);
-		}
 
 		std::vector<node_id_t> P;
 		switch(algorithm){
@@ -570,27 +1872,33 @@ public:
 		}
 
 		relabel(P);
+		if (query_cache != NULL){ query_cache->clear(); }
 	}
 
 
-	void profile_search(const void* query, int ef_search,
-		std::vector< std::vector<node_id_t> > &outdegree_table,
-		std::vector< std::vector<float> > &outdegree_weights,
+	// Searches for query and adds 1 to edge_weights[node*M + i] for every traversal of node -> nodeLinks(node)[i].
+	// The visited set is borrowed from visited_pool, so several threads can profile at once (with their own
+	// edge_weights).
+	void profile_search(const void* query, int ef_search, std::vector<float> &edge_weights,
 		int n_initializations = 100){
+		std::vector<char> context;
+		query = prepareQuery(query, context);
 		node_id_t entry_node = searchInitialization(query, n_initializations);
+		VisitedSet* borrowed = visited_pool.acquire();
+		VisitedSet& visited = *borrowed;
 		// this is a pasted-in profiled version of beamSearch
 		int buffer_size = ef_search;
 		// returns an iterable list of node_id_t's, sorted by distance (ascending)
 		PriorityQueue neighbors; // W in the paper
 		PriorityQueue candidates; // C in the paper
 
-		is_visited.clear();
-		dist_t dist = distance(query, nodeData(entry_node), distance_param);
+		visited.clear();
+		dist_t dist = queryDistance(query, nodeData(entry_node));
 		dist_t max_dist = dist;
 
 		candidates.emplace(-dist, entry_node);
 		neighbors.emplace(dist, entry_node);
-		is_visited.insert(entry_node);
+		visited.insert(entry_node);
 
 		while (!candidates.empty()) {
 			// get nearest element from candidates
@@ -600,17 +1908,14 @@ public:
 			}
 			candidates.pop();
 			node_id_t* d_node_links = nodeLinks(d_node.second);
-			for (int i = 0; i < M; i++){
-				if (!is_visited[d_node_links[i]]){ // if we haven't visited the node yet
-					is_visited.insert(d_node_links[i]);
-					dist = distance(query, nodeData(d_node_links[i]), distance_param);
+			int degree = *(nodeDegree(d_node.second));
+			for (int i = 0; i < degree; i++){
+				if (!visited[d_node_links[i]]){ // if we haven't visited the node yet
+					visited.insert(d_node_links[i]);
+					dist = queryDistance(query, nodeData(d_node_links[i]));
 					// we have done the traversal d_node.second -> d_node_links[i]
 					// so we have to increment the corresponding weight
-					for (int outdegree_index = 0; outdegree_index < outdegree_table[d_node.second].size(); outdegree_index++){
-						if (outdegree_table[d_node.second][outdegree_index] == d_node_links[i]){
-							outdegree_weights[d_node.second][outdegree_index] += 1;
-						}
-					}
+					edge_weights[d_node.second * M + i] += 1;
 					// Include the node in the buffer if buffer isn't full or if node is closer than a node already in the buffer
 					if (neighbors.size() < buffer_size || dist < max_dist) {
 						candidates.emplace(-dist, d_node_links[i]);
@@ -625,12 +1930,17 @@ public:
 				}
 			}
 		}
+		visited_pool.release(borrowed);
 	}
 
 
-	std::vector< int > location_search(const void* query, const int K, int ef_search, int n_initializations = 100){
+	std::vector< node_id_t > location_search(const void* query, const int K, int ef_search, int n_initializations = 100){
+		std::vector<char> context;
+		query = prepareQuery(query, context);
 		node_id_t entry_node = searchInitialization(query, n_initializations);
-		PriorityQueue neighbors = beamSearch(query, entry_node, ef_search);
+		VisitedSet* visited = visited_pool.acquire();
+		PriorityQueue neighbors = beamSearch(query, entry_node, ef_search, *visited);
+		visited_pool.release(visited);
 		std::vector<dist_node_t> results;
 		while(neighbors.size() > K){
 			neighbors.pop();
@@ -641,11 +1951,46 @@ public:
 		}
 		std::sort( results.begin(), results.end(), [](const dist_node_t& left, const dist_node_t& right)
 			{ return left.first < right.first; });
-		std::vector<int> out(K);
-		for (int i = 0; i < K; i++){
+		std::vector<node_id_t> out(results.size());
+		for (size_t i = 0; i < results.size(); i++){
 			out[i] = results[i].second;
 		}
 		return out;
 	}
 
 };
+
+// The dimensions that dispatch_fixed_space has specializations for (common embedding and benchmark sizes).
+template <size_t... dims>
+struct FixedDimensions {};
+typedef FixedDimensions<96, 100, 128, 256, 384, 768, 960> CommonFixedDimensions;
+
+template <typename label_t, typename node_id_t, typename Function>
+bool dispatch_fixed_space(SpaceInterface<float>* space, Function& f, FixedDimensions<>){
+	return false;
+}
+
+template <typename label_t, typename node_id_t, typename Function, size_t dim, size_t... dims>
+bool dispatch_fixed_space(SpaceInterface<float>* space, Function& f, FixedDimensions<dim, dims...>){
+	if (L2FixedSpace<dim>::matches(space)){
+		f.template run< Index<float, label_t, node_id_t, L2FixedSpace<dim>> >();
+		return true;
+	}
+	if (InnerProductFixedSpace<dim>::matches(space)){
+		f.template run< Index<float, label_t, node_id_t, InnerProductFixedSpace<dim>> >();
+		return true;
+	}
+	return dispatch_fixed_space<label_t, node_id_t>(space, f, FixedDimensions<dims...>());
+}
+
+// Runtime dispatcher for the fixed-dimension specializations: calls f.template run<IndexType>() with the Index type
+// specialized for space if there is one (an L2Space or InnerProductSpace of a CommonFixedDimensions dimension),
+// and with the plain Index<float, label_t, node_id_t> otherwise. f then constructs or loads the index as usual, e.g.
+//     struct Query { template <typename IndexType> void run(){ IndexType index(space, filename); ... } };
+// Since every specialization is instantiated, this costs some compile time. Returns true if it specialized.
+template <typename label_t, typename node_id_t = unsigned int, typename Function>
+bool dispatch_fixed_space(SpaceInterface<float>* space, Function& f){
+	if (dispatch_fixed_space<label_t, node_id_t>(space, f, CommonFixedDimensions())){ return true; }
+	f.template run< Index<float, label_t, node_id_t> >();
+	return false;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "ParallelFor.h"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <random>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
+
+/*
+Approximate k-nearest neighbor graph construction by NN-descent (Dong, Moses and Li, "Efficient K-Nearest
+Neighbor Graph Construction for Generic Similarity Measures", WWW 2011). The idea is that a neighbor of a
+neighbor is likely to also be a neighbor: each round, every node introduces its (recently changed) neighbors
+to each other, and every pair that turns out to be closer than a current neighbor replaces it. Since this
+only needs a distance function, it works for any space, and each round is embarrassingly parallel.
+
+distance(a, b) must be safe to call from several threads. Returns, for each node, up to K (distance, node)
+pairs sorted by distance.
+*/
+
+template <typename dist_t, typename node_id_t, typename Distance>
+std::vector< std::vector< std::pair<dist_t, node_id_t> > > nn_descent(size_t n, int K, Distance distance,
+	int max_iterations = 10, float sample_rate = 0.5, float termination_threshold = 0.001, int num_threads = 0){
+
+	struct Neighbor {
+		dist_t dist;
+		node_id_t id;
+		bool is_new; // not yet used in a local join
+		bool operator<(const Neighbor& other) const { return dist < other.dist; }
+	};
+
+	std::vector< std::vector<Neighbor> > pools(n); // kept sorted, at most K entries
+	std::vector< std::mutex > locks(n);
+	// distance of the worst neighbor in each full pool, so that most hopeless candidates are rejected without locking
+	std::vector< std::atomic<dist_t> > worst(n);
+	for (size_t node = 0; node < n; node++){
+		worst[node].store(std::numeric_limits<dist_t>::max(), std::memory_order_relaxed);
+	}
+	K = std::max(1, std::min<int>(K, (int)(n) - 1));
+
+	// Inserts (dist, id) into node's pool if it is closer than the current worst neighbor. Returns true if inserted.
+	auto update = [&](node_id_t node, node_id_t id, dist_t dist){
+		if (!(dist < worst[node].load(std::memory_order_relaxed))){ return false; }
+		std::lock_guard<std::mutex> guard(locks[node]);
+		std::vector<Neighbor>& pool = pools[node];
+		if (pool.size() >= K && !(dist < pool.back().dist)){ return false; }
+		for (const Neighbor& neighbor : pool){
+			if (neighbor.id == id){ return false; }
+		}
+		Neighbor neighbor = {dist, id, true};
+		pool.insert(std::upper_bound(pool.begin(), pool.end(), neighbor), neighbor);
+		if (pool.size() > K){ pool.pop_back(); }
+		if (pool.size() == K){ worst[node].store(pool.back().dist, std::memory_order_relaxed); }
+		return true;
+	};
+
+	// random initial graph
+	parallel_for(0, n, num_threads, [&](size_t node, int thread_id){
+		std::mt19937 rng(node);
+		std::uniform_int_distribution<size_t> pick(0, n - 1);
+		while (pools[node].size() < K){
+			node_id_t id = pick(rng);
+			if (id != node){
+				update(node, id, distance(node, id));
+			}
+		}
+	});
+
+	const int sample_size = std::max(1, (int)(sample_rate * K));
+	std::vector< std::vector<node_id_t> > new_forward(n), old_forward(n), new_reverse(n), old_reverse(n);
+	for (int iteration = 0; iteration < max_iterations; iteration++){
+		// 1. Sample the new and old neighbors of each node, and mark the sampled new neighbors as old.
+		parallel_for(0, n, num_threads, [&](size_t node, int thread_id){
+			new_forward[node].clear();
+			old_forward[node].clear();
+			for (Neighbor& neighbor : pools[node]){
+				if (neighbor.is_new && new_forward[node].size() < sample_size){
+					new_forward[node].push_back(neighbor.id);
+					neighbor.is_new = false;
+				} else if (!neighbor.is_new && old_forward[node].size() < sample_size){
+					old_forward[node].push_back(neighbor.id);
+				}
+			}
+		});
+
+		// 2. Reverse neighbor lists, also sampled.
+		for (size_t node = 0; node < n; node++){
+			new_reverse[node].clear();
+			old_reverse[node].clear();
+		}
+		for (size_t node = 0; node < n; node++){
+			for (node_id_t id : new_forward[node]){
+				if (new_reverse[id].size() < sample_size){ new_reverse[id].push_back(node); }
+			}
+			for (node_id_t id : old_forward[node]){
+				if (old_reverse[id].size() < sample_size){ old_reverse[id].push_back(node); }
+			}
+		}
+
+		// 3. Local join: introduce new neighbors to each other and to the old neighbors.
+		std::vector<size_t> thread_updates(resolve_num_threads(num_threads), 0);
+		parallel_for(0, n, num_threads, [&](size_t node, int thread_id){
+			std::vector<node_id_t> new_candidates(new_forward[node]);
+			new_candidates.insert(new_candidates.end(), new_reverse[node].begin(), new_reverse[node].end());
+			std::vector<node_id_t> old_candidates(old_forward[node]);
+			old_candidates.insert(old_candidates.end(), old_reverse[node].begin(), old_reverse[node].end());
+
+			for (size_t i = 0; i < new_candidates.size(); i++){
+				node_id_t a = new_candidates[i];
+				for (size_t j = i + 1; j < new_candidates.size(); j++){
+					node_id_t b = new_candidates[j];
+					if (a == b){ continue; }
+					dist_t dist = distance(a, b);
+					thread_updates[thread_id] += update(a, b, dist) + update(b, a, dist);
+				}
+				for (node_id_t b : old_candidates){
+					if (a == b){ continue; }
+					dist_t dist = distance(a, b);
+					thread_updates[thread_id] += update(a, b, dist) + update(b, a, dist);
+				}
+			}
+		});
+
+		size_t updates = 0;
+		for (size_t u : thread_updates){ updates += u; }
+		if (updates <= termination_threshold * n * K){ break; }
+	}
+
+	std::vector< std::vector< std::pair<dist_t, node_id_t> > > graph(n);
+	for (size_t node = 0; node < n; node++){
+		for (const Neighbor& neighbor : pools[node]){
+			graph[node].emplace_back(neighbor.dist, neighbor.id);
+		}
+	}
+	return graph;
+}
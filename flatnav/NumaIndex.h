@@ -0,0 +1,139 @@
+#pragma once
+
+#include "Index.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+
+#ifdef FLATNAV_USE_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+/*
+A read-only index for multi-socket machines. Index::load reads the node arena on the calling thread,
+so with the default first-touch policy the whole arena ends up on one NUMA node and every thread on
+the other sockets pays for remote memory accesses during search. NumaIndex loads a saved index with
+one of two placements:
+
+- INTERLEAVE: a single copy of the index, with its pages spread round-robin across all nodes. This
+  costs no extra memory and evens out the memory bandwidth, but about half of the accesses are still remote.
+- REPLICATE: one full copy of the index per node, each allocated on its own node. search() is routed
+  to the replica on the node of the CPU that calls it, so with threads pinned to cores (see benchmark_float32)
+  every access is local and throughput scales with the number of sockets. Costs one copy of the index per node.
+
+This requires libnuma (the build defines FLATNAV_USE_NUMA when it is found). Without libnuma, or on a machine
+without NUMA support, both placements load one ordinary copy of the index.
+*/
+
+template<typename dist_t, typename label_t, typename node_id_t = unsigned int>
+class NumaIndex {
+public:
+	typedef Index<dist_t, label_t, node_id_t> Replica;
+	typedef std::pair<dist_t, label_t> dist_label_t;
+	enum class Placement {INTERLEAVE, REPLICATE};
+
+private:
+	std::vector< Replica* > replicas; // replicas[i] is allocated on NUMA node nodes[i]
+	std::vector< int > nodes;
+	std::vector< int > cpu_to_replica; // index into replicas for each CPU
+
+	// Loads the index on a new thread, so that the calling thread's NUMA policy is left untouched.
+	Replica* loadOnNode(SpaceInterface<dist_t> *space, std::string filename, int node, bool interleave){
+		Replica* replica = NULL;
+		std::thread loader([&](){
+#ifdef FLATNAV_USE_NUMA
+			if (interleave){
+				numa_set_interleave_mask(numa_all_nodes_ptr);
+			} else if (node >= 0){
+				numa_run_on_node(node);
+				numa_set_localalloc();
+			}
+#endif
+			replica = new Replica(space, filename);
+		});
+		loader.join();
+		return replica;
+	}
+
+	Replica& localReplica(){
+#ifdef FLATNAV_USE_NUMA
+		int cpu = sched_getcpu();
+		if (cpu >= 0 && cpu < cpu_to_replica.size()){
+			return *(replicas[cpu_to_replica[cpu]]);
+		}
+#endif
+		return *(replicas[0]);
+	}
+
+public:
+	NumaIndex(SpaceInterface<dist_t> *space, const std::string& filename, Placement placement){
+#ifdef FLATNAV_USE_NUMA
+		if (numa_available() >= 0){
+			if (placement == Placement::REPLICATE){
+				for (int node = 0; node <= numa_max_node(); node++){
+					if (numa_bitmask_isbitset(numa_all_nodes_ptr, node)){
+						nodes.push_back(node);
+						replicas.push_back(loadOnNode(space, filename, node, false));
+					}
+				}
+				cpu_to_replica.resize(numa_num_configured_cpus(), 0);
+				for (int cpu = 0; cpu < cpu_to_replica.size(); cpu++){
+					int node = numa_node_of_cpu(cpu);
+					for (int i = 0; i < nodes.size(); i++){
+						if (nodes[i] == node){ cpu_to_replica[cpu] = i; }
+					}
+				}
+			} else {
+				nodes.push_back(-1);
+				replicas.push_back(loadOnNode(space, filename, -1, true));
+			}
+			return;
+		}
+#endif
+		nodes.push_back(-1);
+		replicas.push_back(loadOnNode(space, filename, -1, false));
+	}
+
+	~NumaIndex(){
+		for (Replica* replica : replicas){
+			delete replica;
+		}
+	}
+
+	NumaIndex(const NumaIndex&) = delete;
+	NumaIndex& operator=(const NumaIndex&) = delete;
+
+	// Searches the replica on the caller's NUMA node. Threads should be pinned to a core (or at least a node),
+	// otherwise the scheduler can move them to another node in the middle of a search.
+	std::vector< dist_label_t > search(const void* query, const int K, int ef_search, int n_initializations = 100,
+		const typename Replica::EarlyTermination& termination = typename Replica::EarlyTermination(),
+		typename Replica::SearchStats* stats = NULL){
+		return localReplica().search(query, K, ef_search, n_initializations, termination, stats);
+	}
+
+	std::vector< dist_label_t > range_search(const void* query, const dist_t radius, int ef_search, int n_initializations = 100){
+		return localReplica().range_search(query, radius, ef_search, n_initializations);
+	}
+
+	// Applies the same (deterministic) reordering to every replica, in parallel. Must not run concurrently with search.
+	void reorder(typename Replica::GraphOrder algorithm){
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < replicas.size(); i++){
+			threads.emplace_back([this, i, algorithm](){
+#ifdef FLATNAV_USE_NUMA
+				if (nodes[i] >= 0){ numa_run_on_node(nodes[i]); }
+#endif
+				replicas[i]->reorder(algorithm);
+			});
+		}
+		for (std::thread& thread : threads){
+			thread.join();
+		}
+	}
+
+	size_t size(){ return replicas[0]->size(); }
+
+	size_t num_replicas(){ return replicas.size(); }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+/*
+Runs fn(i, thread_id) for every i in [begin, end) on num_threads threads. Iterations are
+handed out dynamically in small chunks, since the cost of a graph search (or insert) varies a
+lot from one point to the next. thread_id is in [0, num_threads) and can be used to index
+per-thread scratch space such as visited sets or accumulation buffers.
+
+If num_threads <= 0, we use one thread per core. With a single thread, the loop runs inline
+on the calling thread.
+*/
+
+inline int resolve_num_threads(int num_threads){
+  if (num_threads <= 0){
+    num_threads = std::thread::hardware_concurrency();
+  }
+  return std::max(1, num_threads);
+}
+
+template <typename Function>
+void parallel_for(size_t begin, size_t end, int num_threads, Function fn){
+  if (end <= begin){ return; }
+  num_threads = resolve_num_threads(num_threads);
+  num_threads = (int)(std::min<size_t>(num_threads, end - begin));
+
+  if (num_threads == 1){
+    for (size_t i = begin; i < end; i++){
+      fn(i, 0);
+    }
+    return;
+  }
+
+  const size_t chunk_size = std::max<size_t>(1, std::min<size_t>(64, (end - begin) / (16 * num_threads)));
+  std::atomic<size_t> next(begin);
+
+  auto worker = [&](int thread_id){
+    while (true){
+      size_t chunk_begin = next.fetch_add(chunk_size);
+      if (chunk_begin >= end){ break; }
+      size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+      for (size_t i = chunk_begin; i < chunk_end; i++){
+        fn(i, thread_id);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++){
+    threads.emplace_back(worker, t);
+  }
+  worker(0);
+  for (std::thread& thread : threads){
+    thread.join();
+  }
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+A thin wrapper around Linux perf_event_open, used by the tools to report hardware performance
+counters (cache misses, TLB misses, instructions and cycles) for the search and construction loops.
+This is how we compare graph reorderings by the metric they actually target, rather than by wall time.
+
+Each event is opened separately, so a machine (or VM) that is missing one counter still reports the
+others. Counts are scaled by time_enabled / time_running in case the kernel multiplexes the counters.
+If perf events are unavailable (non-Linux, or kernel.perf_event_paranoid is too strict), available()
+returns false and every value is reported as -1.
+
+The counters measure the thread that created them, plus every thread it starts afterwards (attr.inherit),
+such as the workers of parallel_for. A worker's counts are added when it exits, so stop() should be called
+after the threads have been joined. start() and stop() (and pause() and resume()) must be called from the
+thread that created the counters, and the counters must be created before the worker threads start.
+*/
+
+class PerfCounters {
+  public:
+    enum Event {CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, DTLB_MISSES, NUM_EVENTS};
+
+  private:
+    int _fds[NUM_EVENTS];
+    double _values[NUM_EVENTS];
+
+#ifdef __linux__
+    static int open_event(uint32_t type, uint64_t config){
+      struct perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.inherit = 1; // also count threads started later, e.g. by parallel_for
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      return (int)(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result){
+      return cache | (op << 8) | (result << 16);
+    }
+#endif
+
+  public:
+    PerfCounters(){
+      for (int e = 0; e < NUM_EVENTS; e++){
+        _fds[e] = -1;
+        _values[e] = -1;
+      }
+#ifdef __linux__
+      _fds[CYCLES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      _fds[INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      _fds[L1D_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+        cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+      _fds[LLC_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      _fds[DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+        cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+#endif
+    }
+
+    ~PerfCounters(){
+#ifdef __linux__
+      for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] >= 0){ close(_fds[e]); }
+      }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const {
+      for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] >= 0){ return true; }
+      }
+      return false;
+    }
+
+    // Zeroes the counts (and leaves the counters paused if they were).
+    void reset(){
+#ifdef __linux__
+      for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] >= 0){ ioctl(_fds[e], PERF_EVENT_IOC_RESET, 0); }
+      }
+#endif
+    }
+
+    // pause() and resume() leave parts of the work out of the counts, e.g. reading the next point from a file.
+    void pause(){
+#ifdef __linux__
+      for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] >= 0){ ioctl(_fds[e], PERF_EVENT_IOC_DISABLE, 0); }
+      }
+#endif
+    }
+
+    void resume(){
+#ifdef __linux__
+      for (int e = 0; e < NUM_EVENTS; e++){
+        if (_fds[e] >= 0){ ioctl(_fds[e], PERF_EVENT_IOC_ENABLE, 0); }
+      }
+#endif
+    }
+
+    void start(){
+      reset();
+      resume();
+    }
+
+    void stop(){
+#ifdef __linux__
+      for (int e = 0; e < NUM_EVENTS; e++){
+        _values[e] = -1;
+        if (_fds[e] < 0){ continue; }
+        ioctl(_fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t buffer[3]; // value, time_enabled, time_running
+        if (read(_fds[e], buffer, sizeof(buffer)) == sizeof(buffer) && buffer[2] > 0){
+          _values[e] = (double)(buffer[0]) * ((double)(buffer[1]) / (double)(buffer[2]));
+        }
+      }
+#endif
+    }
+
+    // Count for the most recent start()/stop() interval, or -1 if the event is unavailable.
+    double value(Event e) const {
+      return _values[e];
+    }
+
+    static const char* name(Event e){
+      switch(e){
+        case CYCLES       : return "cycles";
+        case INSTRUCTIONS : return "instructions";
+        case L1D_MISSES   : return "l1d_misses";
+        case LLC_MISSES   : return "llc_misses";
+        case DTLB_MISSES  : return "dtlb_misses";
+        default           : return "unknown";
+      }
+    }
+
+    // Comma-separated event names, e.g. for a CSV header.
+    static void print_header(std::ostream& out, const char* suffix = ""){
+      for (int e = 0; e < NUM_EVENTS; e++){
+        out<<(e > 0 ? "," : "")<<name((Event)(e))<<suffix;
+      }
+    }
+
+    // Comma-separated counts divided by "per" (e.g. the number of queries), -1 for unavailable events.
+    void print_values(std::ostream& out, double per = 1.0) const {
+      for (int e = 0; e < NUM_EVENTS; e++){
+        out<<(e > 0 ? "," : "")<<((_values[e] < 0) ? -1.0 : _values[e] / per);
+      }
+    }
+};
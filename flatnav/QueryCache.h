@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <cstddef>
+#include <utility>
+
+/*
+A bounded, thread-safe LRU cache of search results, for workloads where the same query is issued
+many times (popular items, retries). Entries are keyed by the query bytes together with the search
+parameters, so a hit returns exactly what the search would have returned.
+
+The cache is split into independently locked shards (chosen by the hash of the key) so that
+concurrent searches rarely wait on each other. Each shard evicts its least recently used entry
+when it is full. Since the shards do not fill evenly, a workload whose repeated queries only just fit
+in the capacity will still see some evictions - leave some headroom.
+
+If epsilon > 0, the query is treated as a vector of floats and each coordinate is rounded to a
+grid of width epsilon before hashing. Queries that land in the same grid cell (and so differ by less
+than epsilon in every coordinate) then share a cache entry. This is only valid for float data.
+*/
+
+template <typename dist_t, typename label_t>
+class QueryCache {
+  public:
+    typedef std::vector< std::pair<dist_t, label_t> > Results;
+
+  private:
+    static const size_t NUM_SHARDS = 16;
+
+    struct Shard {
+      std::mutex lock;
+      // most recently used entries are at the front
+      std::list< std::pair<std::string, Results> > entries;
+      std::unordered_map< std::string, typename std::list< std::pair<std::string, Results> >::iterator > lookup;
+    };
+
+    Shard _shards[NUM_SHARDS];
+    size_t _shardCapacity;
+    size_t _querySize;
+    float _epsilon;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+
+    Shard& shardOf(const std::string& key){
+      return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+    }
+
+  public:
+    // capacity is the total number of cached queries, querySize is the size of one query in bytes.
+    QueryCache(size_t capacity, size_t querySize, float epsilon = 0):
+      _shardCapacity((capacity + NUM_SHARDS - 1) / NUM_SHARDS), _querySize(querySize), _epsilon(epsilon),
+      _hits(0), _misses(0) {}
+
+    // Builds the cache key for a query and the parameters that affect its results.
+    // Params must be a plain struct with no padding (or with zeroed padding).
+    template <typename Params>
+    std::string key(const void* query, const Params& params) const {
+      std::string k(reinterpret_cast<const char*>(&params), sizeof(Params));
+      if (_epsilon > 0){
+        const float* x = reinterpret_cast<const float*>(query);
+        size_t dim = _querySize / sizeof(float);
+        k.reserve(sizeof(Params) + dim * sizeof(int));
+        for (size_t i = 0; i < dim; i++){
+          int cell = (int)(std::floor(x[i] / _epsilon));
+          k.append(reinterpret_cast<const char*>(&cell), sizeof(int));
+        }
+      } else {
+        k.append(reinterpret_cast<const char*>(query), _querySize);
+      }
+      return k;
+    }
+
+    // Copies the cached results for key into results. Returns false (and leaves results alone) on a miss.
+    bool get(const std::string& key, Results& results){
+      Shard& shard = shardOf(key);
+      {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.lookup.find(key);
+        if (it != shard.lookup.end()){
+          shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+          results = it->second->second;
+          _hits++;
+          return true;
+        }
+      }
+      _misses++;
+      return false;
+    }
+
+    void put(const std::string& key, const Results& results){
+      if (_shardCapacity == 0){ return; }
+      Shard& shard = shardOf(key);
+      std::lock_guard<std::mutex> guard(shard.lock);
+      auto it = shard.lookup.find(key);
+      if (it != shard.lookup.end()){
+        it->second->second = results;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return;
+      }
+      if (shard.entries.size() >= _shardCapacity){
+        shard.lookup.erase(shard.entries.back().first);
+        shard.entries.pop_back();
+      }
+      shard.entries.emplace_front(key, results);
+      shard.lookup[key] = shard.entries.begin();
+    }
+
+    // Removes all entries (e.g. because the index changed). The hit and miss counters are kept.
+    void clear(){
+      for (size_t s = 0; s < NUM_SHARDS; s++){
+        std::lock_guard<std::mutex> guard(_shards[s].lock);
+        _shards[s].entries.clear();
+        _shards[s].lookup.clear();
+      }
+    }
+
+    size_t size(){
+      size_t total = 0;
+      for (size_t s = 0; s < NUM_SHARDS; s++){
+        std::lock_guard<std::mutex> guard(_shards[s].lock);
+        total += _shards[s].entries.size();
+      }
+      return total;
+    }
+
+    size_t hits() const { return _hits.load(); }
+    size_t misses() const { return _misses.load(); }
+
+    void reset_counters(){
+      _hits = 0;
+      _misses = 0;
+    }
+
+    QueryCache(const QueryCache&) = delete;
+    QueryCache& operator=(const QueryCache&) = delete;
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "Index.h"
+#include "ParallelFor.h"
+
+#include <vector>
+#include <queue>
+#include <string>
+#include <fstream>
+#include <functional> // for std::greater
+#include <utility>
+#include <iterator> // for std::make_move_iterator
+
+/*
+A set of independent Index shards that behaves like a single index. Points are dealt out to the
+shards round-robin, so each shard holds about N / num_shards points. This sidesteps the limits of
+a single Index (the node ID range and one contiguous arena) and lets us build and reorder the shards
+in parallel, which is much faster than building one big graph since insert and reorder costs grow
+superlinearly with the size of the graph.
+
+A query searches every shard with the same K and ef_search and merges the per-shard top-K lists.
+Each shard is searched exhaustively at its own scale, so recall at a given ef_search is usually a
+bit higher than for a single index, but every query does num_shards graph searches.
+
+Labels are stored as-is in the shards, so they should be unique across the whole ShardedIndex.
+*/
+
+template<typename dist_t, typename label_t, typename node_id_t = unsigned int>
+class ShardedIndex {
+public:
+	typedef std::pair<dist_t, label_t> dist_label_t;
+	typedef Index<dist_t, label_t, node_id_t> Shard;
+	typedef typename Shard::GraphOrder GraphOrder;
+
+private:
+	std::vector< Shard* > shards;
+	size_t data_size_bytes;
+	size_t num_added; // total number of add() calls so far, used for the round-robin assignment
+
+	static std::string shardFilename(const std::string& location, size_t shard){
+		return location + ".shard" + std::to_string(shard);
+	}
+
+public:
+	// N is the max number of nodes across all shards, M is the max number of edges per node.
+	ShardedIndex(SpaceInterface<dist_t> *space, int num_shards, size_t N, int M):
+		data_size_bytes(space->get_data_size()), num_added(0) {
+		size_t shard_capacity = (N + num_shards - 1) / num_shards;
+		for (int s = 0; s < num_shards; s++){
+			shards.push_back(new Shard(space, shard_capacity, M));
+		}
+	}
+
+	// Loads an index written by save(): a small manifest at "location" and one index file per shard.
+	ShardedIndex(SpaceInterface<dist_t> *space, const std::string& location, bool use_mmap = false):
+		data_size_bytes(space->get_data_size()), num_added(0) {
+		std::ifstream in(location, std::ios::binary);
+		size_t num_shards = 0;
+		in.read(reinterpret_cast< char *>(&num_shards), sizeof(size_t));
+		in.read(reinterpret_cast< char *>(&num_added), sizeof(size_t));
+		in.close();
+		for (size_t s = 0; s < num_shards; s++){
+			std::string filename = shardFilename(location, s);
+			shards.push_back(new Shard(space, filename, use_mmap));
+		}
+	}
+
+	~ShardedIndex(){
+		for (Shard* shard : shards){
+			delete shard;
+		}
+	}
+
+	ShardedIndex(const ShardedIndex&) = delete;
+	ShardedIndex& operator=(const ShardedIndex&) = delete;
+
+	bool add(void* data, label_t& label, int ef_construction, int n_initializations = 100){
+		Shard* shard = shards[num_added % shards.size()];
+		num_added++;
+		return shard->add(data, label, ef_construction, n_initializations);
+	}
+
+	// Adds n points, stored contiguously in "data", with the given labels. The shards are built in parallel
+	// (one thread per shard at most), and each shard inserts its points in the order they appear in data.
+	// The result is the same as calling add() on each point in order.
+	void add_batch(const void* data, const label_t* labels, size_t n, int ef_construction, int num_threads = 0,
+		int n_initializations = 100){
+		size_t num_shards = shards.size();
+		parallel_for(0, num_shards, num_threads, [&](size_t s, int thread_id){
+			// point i goes to shard (num_added + i) % num_shards
+			size_t first = (s + num_shards - (num_added % num_shards)) % num_shards;
+			for (size_t i = first; i < n; i += num_shards){
+				label_t label = labels[i];
+				void* point = (void*)(reinterpret_cast<const char*>(data) + i*data_size_bytes);
+				shards[s]->add(point, label, ef_construction, n_initializations);
+			}
+		});
+		num_added += n;
+	}
+
+	// Searches every shard, one after the other, and merges the results. To search many queries at once, use
+	// search_batch, which also searches the shards of a query in parallel.
+	std::vector< dist_label_t > search(const void* query, const int K, int ef_search, int n_initializations = 100){
+		std::vector< std::vector< dist_label_t > > partial(shards.size());
+		for (size_t s = 0; s < shards.size(); s++){
+			partial[s] = shards[s]->search(query, K, ef_search, n_initializations);
+		}
+		return merge(partial, K);
+	}
+
+	// Searches num_queries queries, stored contiguously in "queries", and returns the results of each. All of the
+	// (query, shard) pairs go through a single parallel_for, so the threads are started once per batch instead of
+	// once per query, and the shards of a query are searched concurrently even when the batch is small.
+	std::vector< std::vector< dist_label_t > > search_batch(const void* queries, size_t num_queries, const int K,
+		int ef_search, int num_threads = 0, int n_initializations = 100){
+		size_t num_shards = shards.size();
+		std::vector< std::vector< dist_label_t > > partial(num_queries * num_shards);
+		parallel_for(0, num_queries * num_shards, num_threads, [&](size_t i, int thread_id){
+			const void* query = reinterpret_cast<const char*>(queries) + (i / num_shards)*data_size_bytes;
+			partial[i] = shards[i % num_shards]->search(query, K, ef_search, n_initializations);
+		});
+		std::vector< std::vector< dist_label_t > > results(num_queries);
+		for (size_t q = 0; q < num_queries; q++){
+			std::vector< std::vector< dist_label_t > > lists(std::make_move_iterator(partial.begin() + q*num_shards),
+				std::make_move_iterator(partial.begin() + (q+1)*num_shards));
+			results[q] = merge(lists, K);
+		}
+		return results;
+	}
+
+	// Merges sorted (ascending distance) result lists into one sorted list of at most K results.
+	static std::vector< dist_label_t > merge(const std::vector< std::vector< dist_label_t > >& lists, const int K){
+		// heap of (distance, list) pairs, one per list that still has results left
+		typedef std::pair<dist_t, size_t> head_t;
+		std::priority_queue< head_t, std::vector< head_t >, std::greater< head_t > > heads;
+		std::vector<size_t> positions(lists.size(), 0);
+		for (size_t l = 0; l < lists.size(); l++){
+			if (!lists[l].empty()){
+				heads.emplace(lists[l][0].first, l);
+			}
+		}
+
+		std::vector< dist_label_t > results;
+		results.reserve(K);
+		while (!heads.empty() && results.size() < K){
+			size_t l = heads.top().second;
+			heads.pop();
+			results.push_back(lists[l][positions[l]]);
+			positions[l]++;
+			if (positions[l] < lists[l].size()){
+				heads.emplace(lists[l][positions[l]].first, l);
+			}
+		}
+		return results;
+	}
+
+	void reorder(GraphOrder algorithm, int num_threads = 0){
+		parallel_for(0, shards.size(), num_threads, [&](size_t s, int thread_id){
+			shards[s]->reorder(algorithm);
+		});
+	}
+
+	void save(const std::string& location){
+		std::ofstream out(location, std::ios::binary);
+		size_t num_shards = shards.size();
+		out.write(reinterpret_cast< char *>(&num_shards), sizeof(size_t));
+		out.write(reinterpret_cast< char *>(&num_added), sizeof(size_t));
+		out.close();
+		for (size_t s = 0; s < num_shards; s++){
+			shards[s]->save(shardFilename(location, s));
+		}
+	}
+
+	size_t size(){
+		size_t total = 0;
+		for (Shard* shard : shards){
+			total += shard->size();
+		}
+		return total;
+	}
+
+	size_t num_shards(){ return shards.size(); }
+
+	Shard& shard(size_t s){ return *(shards[s]); }
+};
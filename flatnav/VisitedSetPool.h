@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+/*
+A pool of visited sets, so that several threads can search the same index at once.
+Each search borrows a set for its duration and gives it back afterwards. Sets are only
+allocated when every existing set is in use, so the pool grows to the number of threads
+that search concurrently and then stays there. Each set is as large as the index, so
+this is much cheaper than allocating a fresh set per query.
+
+The set type must provide a constructor that takes the table size and a clear() method
+(ExplicitSet and HashBasedBooleanSet both do).
+*/
+
+template <typename VisitedSet>
+class VisitedSetPool {
+  private:
+    std::vector<VisitedSet*> _pool;
+    std::mutex _lock;
+    size_t _setSize;
+
+  public:
+    VisitedSetPool(): _setSize(0) {}
+
+    VisitedSetPool(const size_t setSize): _setSize(setSize) {}
+
+    ~VisitedSetPool(){
+      for (VisitedSet* set : _pool){
+        delete set;
+      }
+    }
+
+    VisitedSet* acquire(){
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!_pool.empty()){
+          VisitedSet* set = _pool.back();
+          _pool.pop_back();
+          return set;
+        }
+      }
+      return new VisitedSet(_setSize);
+    }
+
+    void release(VisitedSet* set){
+      std::lock_guard<std::mutex> guard(_lock);
+      _pool.push_back(set);
+    }
+
+    // Frees all of the pooled sets and changes the size of future sets.
+    // Must not be called while any set is checked out of the pool.
+    void resize(const size_t setSize){
+      std::lock_guard<std::mutex> guard(_lock);
+      for (VisitedSet* set : _pool){
+        delete set;
+      }
+      _pool.clear();
+      _setSize = setSize;
+    }
+
+    VisitedSetPool(const VisitedSetPool&) = delete;
+    VisitedSetPool& operator=(const VisitedSetPool&) = delete;
+};
@@ -1,15 +1,37 @@
 #include <stdexcept>
 #include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
 
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 
 #include <Index.h>
 #include <SpaceInterface.h>
+#include <ParallelFor.h>
 
 namespace py = pybind11;
 
-template<typename dist_t, typename label_t>
+// Builds the space for a (data type, distance type) pair. Float indexes support L2 and Angular,
+// uint8 indexes only support L2 (see construct_uint8).
+inline SpaceInterface<float>* makeSpace(const std::string& spaceType, size_t dim, float) {
+  if (spaceType == "L2") {
+    return new L2Space(dim);
+  } else if (spaceType == "Angular") {
+    return new InnerProductSpace(dim);
+  }
+  throw std::invalid_argument("Invalid Space '" + spaceType + "' used to construct Index");
+}
+
+inline SpaceInterface<int>* makeSpace(const std::string& spaceType, size_t dim, uint8_t) {
+  if (spaceType == "L2") {
+    return new L2SpaceI(dim);
+  }
+  throw std::invalid_argument("Invalid Space '" + spaceType + "' used to construct uint8 Index");
+}
+
+template<typename data_t, typename dist_t, typename label_t>
 class PyIndex {
   private:
     Index<dist_t, label_t>* index;
@@ -17,77 +39,213 @@ class PyIndex {
     size_t dim;
     int added;
 
-    void getSpaceFromType(std::string& spaceType) {
-      if (spaceType == "L2") {
-        space = new L2Space(dim);
-      } else if (spaceType == "Angular") {
-        space = new InnerProductSpace(dim);
-      } else {
-        throw std::invalid_argument("Invalid Space '" + spaceType + "' used to construct Index");
-      }
-    }
-  
+    typedef py::array_t<data_t, py::array::c_style | py::array::forcecast> data_array_t;
+
 public:
-  PyIndex(std::string spaceType, size_t _dim, int _N, int _M): dim(_dim), added(0) {
-    getSpaceFromType(spaceType);
+  PyIndex(std::string spaceType, size_t _dim, size_t _N, int _M): dim(_dim), added(0) {
+    space = makeSpace(spaceType, dim, data_t());
     index = new Index<dist_t, label_t>(space, _N, _M);
 	}
 
-  PyIndex(std::string spaceType, size_t _dim, std::string filename): dim(_dim) {
-    getSpaceFromType(spaceType);
-    index = new Index<dist_t, label_t>(space, filename);
+  PyIndex(std::string spaceType, size_t _dim, std::string filename, bool use_mmap = false): dim(_dim) {
+    // If use_mmap is true, the index file is memory-mapped rather than read into memory (see Index::load).
+    space = makeSpace(spaceType, dim, data_t());
+    index = new Index<dist_t, label_t>(space, filename, use_mmap);
+    added = index->size();
+  }
+
+  // The labels of the next num_points points: labels_obj, or consecutive labels after those already added.
+  std::vector<label_t> makeLabels(py::object labels_obj, size_t num_points) {
+    std::vector<label_t> labels(num_points);
+    if (labels_obj.is_none()) {
+      for (size_t n = 0; n < num_points; n++) {
+        labels[n] = added + n;
+      }
+      return labels;
+    }
+    py::array_t<label_t, py::array::c_style | py::array::forcecast> label_array(labels_obj);
+    if (label_array.ndim() != 1 || label_array.shape(0) != num_points) {
+      throw std::invalid_argument("Labels have incorrect dimensions");
+    }
+    std::copy(label_array.data(), label_array.data() + num_points, labels.begin());
+    return labels;
   }
 
   void Add(
-    py::array_t<float, py::array::c_style | py::array::forcecast> data, 
+    data_array_t data, 
     int ef_construction, 
-    py::object labels_obj = py::none()) {
+    py::object labels_obj = py::none(),
+    int num_threads = 1) {
+    // Inserts run one at a time (Index::add is not thread-safe), but the GIL is released while they run.
+    // Do not search this index from another Python thread while Add is running. If the index is still empty
+    // and num_threads is not 1, the points are inserted at once by BulkBuild on num_threads threads instead.
 
     if (data.ndim() != 2 || data.shape(1) != dim) {
       throw std::invalid_argument("Data has incorrect dimensions");
     }
+    if (num_threads != 1 && this->index->size() == 0) {
+      BulkBuild(data, ef_construction, labels_obj, num_threads);
+      return;
+    }
+    size_t num_points = data.shape(0);
+    const data_t* points = data.data();
+    std::vector<label_t> labels = makeLabels(labels_obj, num_points);
 
-    if (labels_obj.is_none())  {
-      for (size_t n = 0; n < data.shape(0); n++) {
-        this->index->add((void*)data.data(n), added, ef_construction);  
-        added++;
-      }    
-    } else {  
-      py::array_t<label_t, py::array::c_style | py::array::forcecast> labels(labels_obj);
-      if (labels.ndim() != 1 || labels.shape(0) != data.shape(0)) {
-        throw std::invalid_argument("Labels have incorrect dimensions");
-      }
+    py::gil_scoped_release release;
+    for (size_t n = 0; n < num_points; n++) {
+      this->index->add((void*)(points + n * dim), labels[n], ef_construction);
+      added++;
+    }
+  }
 
-      for (size_t n = 0; n < data.shape(0); n++) {
-        label_t l = *labels.data(n);
-        this->index->add((void*)data.data(n), l, ef_construction);  
-        added++;
-      }  
+  void BulkBuild(data_array_t data, int ef_construction, py::object labels_obj = py::none(), int num_threads = 0,
+    int knn = 0, int iterations = 10) {
+    // Builds the graph over all of data at once on num_threads threads (0 for one per core), see
+    // Index::bulk_build. The index must be empty. The GIL is released while it runs.
+    if (data.ndim() != 2 || data.shape(1) != dim) {
+      throw std::invalid_argument("Data has incorrect dimensions");
     }
+    size_t num_points = data.shape(0);
+    std::vector<label_t> labels = makeLabels(labels_obj, num_points);
+    bool built;
+    {
+      py::gil_scoped_release release;
+      built = this->index->bulk_build(data.data(), labels.data(), num_points, ef_construction, num_threads, knn,
+        iterations);
+    }
+    if (!built) {
+      throw std::invalid_argument("BulkBuild needs an empty index with room for all of the data");
+    }
+    added = num_points;
   }
 
-  py::array_t<label_t> Search(py::array_t<float, py::array::c_style | py::array::forcecast> queries, int K, int ef_search) {
+  py::object Search(data_array_t queries, int K, int ef_search,
+    int patience = 0, float min_improvement = 0, bool return_stats = false, int num_threads = 1) {
+    // Returns (distances, labels) for the top-K results, each of shape (num_queries, K). If fewer than K 
+    // results are found, the remaining entries have label -1. If return_stats is true, returns 
+    // (distances, labels, stats) where stats is a dict of per-query arrays (see Index::SearchStats).
+    // The queries are split across num_threads threads (0 for one per core) and the GIL is released.
     if (queries.ndim() != 2 || queries.shape(1) != dim) {
       throw std::invalid_argument("Queries have incorrect dimensions");
     }
     size_t num_queries = queries.shape(0);
+    const data_t* query_data = queries.data();
 
+    dist_t* distances = new dist_t[num_queries * K];
     label_t* results = new label_t[num_queries * K];
+    std::fill(distances, distances + num_queries * K, std::numeric_limits<dist_t>::max());
+    std::fill(results, results + num_queries * K, (label_t)(-1));
+    typename Index<dist_t, label_t>::EarlyTermination termination(patience, min_improvement);
 
-    for (size_t q = 0; q < num_queries; q++) {
-      std::vector<std::pair<dist_t, label_t>> topK = this->index->search(queries.data(q), K, ef_search);
-      for (size_t i = 0; i < topK.size(); i++) {
-        results[q * K + i] = topK[i].second;
-      }
+    py::array_t<size_t> distance_computations(return_stats ? num_queries : 0);
+    py::array_t<size_t> hops(return_stats ? num_queries : 0);
+    py::array_t<size_t> visited_inserts(return_stats ? num_queries : 0);
+    py::array_t<dist_t> entry_distance(return_stats ? num_queries : 0);
+    py::array_t<dist_t> final_distance(return_stats ? num_queries : 0);
+    py::array_t<double> initialization_ns(return_stats ? num_queries : 0);
+
+    size_t* distance_computations_out = distance_computations.mutable_data();
+    size_t* hops_out = hops.mutable_data();
+    size_t* visited_inserts_out = visited_inserts.mutable_data();
+    dist_t* entry_distance_out = entry_distance.mutable_data();
+    dist_t* final_distance_out = final_distance.mutable_data();
+    double* initialization_ns_out = initialization_ns.mutable_data();
+
+    {
+      py::gil_scoped_release release;
+      parallel_for(0, num_queries, num_threads, [&](size_t q, int thread_id) {
+        typename Index<dist_t, label_t>::SearchStats stats;
+        std::vector<std::pair<dist_t, label_t>> topK = this->index->search(query_data + q * dim, K, ef_search, 100,
+          termination, return_stats ? &stats : NULL);
+        for (size_t i = 0; i < topK.size(); i++) {
+          distances[q * K + i] = topK[i].first;
+          results[q * K + i] = topK[i].second;
+        }
+        if (return_stats) {
+          distance_computations_out[q] = stats.distance_computations;
+          hops_out[q] = stats.hops;
+          visited_inserts_out[q] = stats.visited_inserts;
+          entry_distance_out[q] = stats.entry_distance;
+          final_distance_out[q] = stats.final_distance;
+          initialization_ns_out[q] = stats.initialization_ns;
+        }
+      });
     }
 
-    py::capsule free_when_done(results, [](void* ptr){ delete ptr;});
+    py::capsule free_distances(distances, [](void* ptr){ delete[] static_cast<dist_t*>(ptr);});
+    py::capsule free_labels(results, [](void* ptr){ delete[] static_cast<label_t*>(ptr);});
 
-    return py::array_t<label_t>(
+    py::array_t<dist_t> distances_array(
+      {num_queries,(size_t) K},
+      {K * sizeof(dist_t), sizeof(dist_t)},
+      distances,
+      free_distances
+    );
+    py::array_t<label_t> labels(
       {num_queries,(size_t) K},
       {K * sizeof(label_t), sizeof(label_t)},
       results,
-      free_when_done
+      free_labels
+    );
+    if (!return_stats) {
+      return py::make_tuple(distances_array, labels);
+    }
+
+    py::dict stats_dict;
+    stats_dict["distance_computations"] = distance_computations;
+    stats_dict["hops"] = hops;
+    stats_dict["visited_inserts"] = visited_inserts;
+    stats_dict["entry_distance"] = entry_distance;
+    stats_dict["final_distance"] = final_distance;
+    stats_dict["initialization_ns"] = initialization_ns;
+    return py::make_tuple(distances_array, labels, stats_dict);
+  }
+
+  py::tuple RangeSearch(data_array_t queries, dist_t radius, int ef_search,
+    int num_threads = 1) {
+    // Returns (lims, distances, labels) in CSR form: the results for query q are
+    // distances[lims[q]:lims[q+1]] and labels[lims[q]:lims[q+1]], sorted by distance.
+    if (queries.ndim() != 2 || queries.shape(1) != dim) {
+      throw std::invalid_argument("Queries have incorrect dimensions");
+    }
+    size_t num_queries = queries.shape(0);
+    const data_t* query_data = queries.data();
+
+    size_t* lims = new size_t[num_queries + 1];
+    dist_t* distances_out;
+    label_t* labels_out;
+    size_t num_results = 0;
+
+    {
+      py::gil_scoped_release release;
+      std::vector<std::vector<std::pair<dist_t, label_t>>> inRange(num_queries);
+      parallel_for(0, num_queries, num_threads, [&](size_t q, int thread_id) {
+        inRange[q] = this->index->range_search(query_data + q * dim, radius, ef_search);
+      });
+
+      lims[0] = 0;
+      for (size_t q = 0; q < num_queries; q++) {
+        lims[q + 1] = lims[q] + inRange[q].size();
+      }
+      num_results = lims[num_queries];
+      distances_out = new dist_t[num_results];
+      labels_out = new label_t[num_results];
+      for (size_t q = 0; q < num_queries; q++) {
+        for (size_t i = 0; i < inRange[q].size(); i++) {
+          distances_out[lims[q] + i] = inRange[q][i].first;
+          labels_out[lims[q] + i] = inRange[q][i].second;
+        }
+      }
+    }
+
+    py::capsule free_lims(lims, [](void* ptr){ delete[] static_cast<size_t*>(ptr);});
+    py::capsule free_distances(distances_out, [](void* ptr){ delete[] static_cast<dist_t*>(ptr);});
+    py::capsule free_labels(labels_out, [](void* ptr){ delete[] static_cast<label_t*>(ptr);});
+
+    return py::make_tuple(
+      py::array_t<size_t>({num_queries + 1}, {sizeof(size_t)}, lims, free_lims),
+      py::array_t<dist_t>({num_results}, {sizeof(dist_t)}, distances_out, free_distances),
+      py::array_t<label_t>({num_results}, {sizeof(label_t)}, labels_out, free_labels)
     );
   }
 
@@ -100,17 +258,41 @@ public:
         this->index->reorder(Index<dist_t, label_t>::GraphOrder::OUT_DEG);
       } else if (alg == "rcm") {
         this->index->reorder(Index<dist_t, label_t>::GraphOrder::RCM);
+      } else if (alg == "rcm_2hop") {
+        this->index->reorder(Index<dist_t, label_t>::GraphOrder::RCM_2HOP);
       } else if (alg == "hub_sort") {
         this->index->reorder(Index<dist_t, label_t>::GraphOrder::HUB_SORT);
       } else if (alg == "hub_cluster") {
         this->index->reorder(Index<dist_t, label_t>::GraphOrder::HUB_CLUSTER);
       } else if (alg == "DBG") {
         this->index->reorder(Index<dist_t, label_t>::GraphOrder::DBG);
+      } else if (alg == "bcorder") {
+        this->index->reorder(Index<dist_t, label_t>::GraphOrder::BCORDER);
       } else {
         throw std::invalid_argument("'" + alg + "' is not a supported graph reordering algorithm");
       }
   }
 
+  void ProfileReorder(data_array_t queries, int ef_search, std::string alg, int num_threads = 0) {
+    // Reorders the graph using the edges traversed while searching for the given (representative) queries.
+    if (queries.ndim() != 2 || queries.shape(1) != dim) {
+      throw std::invalid_argument("Queries have incorrect dimensions");
+    }
+    typename Index<dist_t, label_t>::ProfileOrder order;
+    if (alg == "gorder") {
+      order = Index<dist_t, label_t>::ProfileOrder::GORDER;
+    } else if (alg == "rcm") {
+      order = Index<dist_t, label_t>::ProfileOrder::RCM;
+    } else {
+      throw std::invalid_argument("'" + alg + "' is not a supported profile-guided reordering algorithm");
+    }
+    void* query_data = (void*)(queries.data());
+    int num_queries = queries.shape(0);
+
+    py::gil_scoped_release release;
+    this->index->profile_reorder(query_data, num_queries, ef_search, order, num_threads);
+  }
+
   void Save(std::string filename) {
     this->index->save(filename);
   }
@@ -142,16 +324,29 @@ double ComputeRecall(py::array_t<label_t> results, py::array_t<label_t> gtruths)
   return avg_recall /= (results.shape(0) * results.shape(1));
 }
 
-using PyIndexWithTypes = PyIndex<float, int>;
+template<typename PyIndexType>
+void bindIndex(py::module& m, const char* name) {
+  py::class_<PyIndexType>(m, name)
+      .def(py::init<std::string, size_t, size_t, int>(), py::arg("space"), py::arg("dim"), py::arg("N"), py::arg("M"))
+      .def(py::init<std::string, size_t, std::string, bool>(), py::arg("space"), py::arg("dim"), py::arg("save_loc"),
+        py::arg("mmap")=false)
+      .def("Add", &PyIndexType::Add, py::arg("data"), py::arg("ef_construction"), py::arg("labels")=py::none(),
+        py::arg("num_threads")=1)
+      .def("BulkBuild", &PyIndexType::BulkBuild, py::arg("data"), py::arg("ef_construction"),
+        py::arg("labels")=py::none(), py::arg("num_threads")=0, py::arg("knn")=0, py::arg("iterations")=10)
+      .def("Search", &PyIndexType::Search, py::arg("queries"), py::arg("K"), py::arg("ef_search"),
+        py::arg("patience")=0, py::arg("min_improvement")=0.0f, py::arg("return_stats")=false, py::arg("num_threads")=1)
+      .def("RangeSearch", &PyIndexType::RangeSearch, py::arg("queries"), py::arg("radius"), py::arg("ef_search"),
+        py::arg("num_threads")=1)
+      .def("Reorder", &PyIndexType::Reorder, py::arg("alg"))
+      .def("ProfileReorder", &PyIndexType::ProfileReorder, py::arg("queries"), py::arg("ef_search"), py::arg("alg"),
+        py::arg("num_threads")=0)
+      .def("Save", &PyIndexType::Save, py::arg("filename"));
+}
 
 PYBIND11_MODULE(flatnav, m) {
-  py::class_<PyIndexWithTypes>(m, "Index")
-      .def(py::init<std::string, size_t, int, int>(), py::arg("space"), py::arg("dim"), py::arg("N"), py::arg("M"))
-      .def(py::init<std::string, size_t, std::string>(), py::arg("space"), py::arg("dim"), py::arg("save_loc"))
-      .def("Add", &PyIndexWithTypes::Add, py::arg("data"), py::arg("ef_construction"), py::arg("labels")=py::none())
-      .def("Search", &PyIndexWithTypes::Search, py::arg("queries"), py::arg("K"), py::arg("ef_search"))
-      .def("Reorder", &PyIndexWithTypes::Reorder, py::arg("alg"))
-      .def("Save", &PyIndexWithTypes::Save, py::arg("filename"));
+  bindIndex<PyIndex<float, float, int>>(m, "Index");
+  bindIndex<PyIndex<uint8_t, int, int>>(m, "IndexUInt8");
 
   m.def("ComputeRecall", &ComputeRecall<int>, py::arg("results"), py::arg("gtruths"));
 }
@@ -24,7 +24,7 @@ index.Reorder("gorder")
 
 index.Save("mnist16.bin")
 
-results = index.Search(queries, K, ef_search)
+distances, results = index.Search(queries, K, ef_search, num_threads=0)
 print("Results: ", results.shape)
 
 mean_recall = 0.0
@@ -45,5 +45,42 @@ print("Cpp Recall: ", flatnav.ComputeRecall(results, gtruths))
 
 index2 = flatnav.Index(space="L2", dim=queries.shape[1], save_loc="./mnist16.bin")
 
-results2 = index2.Search(queries, K, ef_search)
-print("Recall with Reloaded Index: ", flatnav.ComputeRecall(results2, gtruths))
\ No newline at end of file
+distances2, results2 = index2.Search(queries, K, ef_search)
+print("Recall with Reloaded Index: ", flatnav.ComputeRecall(results2, gtruths))
+
+# Searching with several threads must give the same results as one thread
+distances3, results3 = index2.Search(queries, K, ef_search, num_threads=4)
+assert (results3 == results2).all()
+
+# Memory-mapped load
+index3 = flatnav.Index(space="L2", dim=queries.shape[1], save_loc="./mnist16.bin", mmap=True)
+distances3, results3 = index3.Search(queries, K, ef_search)
+print("Recall with Memory-Mapped Index: ", flatnav.ComputeRecall(results3, gtruths))
+assert (results3 == results2).all()
+
+# Range search, in CSR form: the results for query q are labels[lims[q]:lims[q+1]]
+radius = float(distances2[:, 9].max())
+lims, range_distances, range_labels = index2.RangeSearch(queries[:100], radius, ef_search, num_threads=0)
+print("Range Search Results: ", lims[-1])
+assert lims.shape[0] == 101 and lims[-1] == range_labels.shape[0]
+assert (range_distances <= radius).all()
+
+# Every graph ordering, and profile-guided ordering with the queries
+for alg in ["in_deg", "out_deg", "rcm", "rcm_2hop", "hub_sort", "hub_cluster", "DBG", "bcorder", "gorder"]:
+  index2.Reorder(alg)
+for alg in ["rcm", "gorder"]:
+  index2.ProfileReorder(queries[:1000], ef_search, alg)
+distances3, results3 = index2.Search(queries, K, ef_search, num_threads=0)
+print("Recall after Reordering: ", flatnav.ComputeRecall(results3, gtruths))
+
+# uint8 index (MNIST pixels fit in a byte)
+index4 = flatnav.IndexUInt8(space="L2", dim=data.shape[1], N=data.shape[0], M=M)
+index4.Add(data=data.astype(np.uint8), ef_construction=ef_construction)
+distances4, results4 = index4.Search(queries.astype(np.uint8), K, ef_search, num_threads=0)
+print("Recall with uint8 Index: ", flatnav.ComputeRecall(results4, gtruths))
+
+# Parallel build: Add on an empty index with num_threads other than 1 builds the graph with BulkBuild
+index5 = flatnav.Index(space="L2", dim=data.shape[1], N=data.shape[0], M=M)
+index5.Add(data=data, ef_construction=ef_construction, num_threads=0)
+distances5, results5 = index5.Search(queries, K, ef_search, num_threads=0)
+print("Recall with Bulk-Built Index: ", flatnav.ComputeRecall(results5, gtruths))
@@ -0,0 +1,944 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <random>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+
+#include "../flatnav/Index.h"
+#include "../flatnav/ShardedIndex.h"
+#include "../flatnav/DiskIndex.h"
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+
+/*
+Regression tests for Index. Each test builds a small index on random data and checks it against brute force,
+so they run in a few seconds and need no data files. The tests are registered with ctest (see CMakeLists.txt).
+Usage: regression_tests [test_name], which runs every test if no name is given.
+*/
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    if (!(condition)){ \
+        std::cerr<<__FILE__<<":"<<__LINE__<<": check failed: "<<#condition<<std::endl; \
+        failures++; \
+    }
+
+static const int DIM = 16;
+
+std::vector<float> randomData(int num_points, int seed){
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> gaussian;
+    std::vector<float> data(num_points*DIM);
+    for (float& x : data){
+        x = gaussian(rng);
+    }
+    return data;
+}
+
+// points around 50 random centers, which is where a graph is most likely to split into components
+std::vector<float> clusteredData(int num_points, int seed){
+    std::mt19937 center_rng(7);
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> gaussian;
+    std::vector<float> centers(50*DIM);
+    for (float& x : centers){
+        x = 10*gaussian(center_rng);
+    }
+    std::uniform_int_distribution<int> pick(0, 49);
+    std::vector<float> data(num_points*DIM);
+    for (int i = 0; i < num_points; i++){
+        int center = pick(rng);
+        for (int j = 0; j < DIM; j++){
+            data[i*DIM + j] = centers[center*DIM + j] + gaussian(rng);
+        }
+    }
+    return data;
+}
+
+float squaredL2(const float* a, const float* b){
+    float dist = 0;
+    for (int i = 0; i < DIM; i++){
+        dist += (a[i] - b[i])*(a[i] - b[i]);
+    }
+    return dist;
+}
+
+// (distance, row) of every point, sorted by distance to the query
+std::vector< std::pair<float, int> > bruteForce(const std::vector<float>& data, const float* query){
+    int num_points = data.size() / DIM;
+    std::vector< std::pair<float, int> > result(num_points);
+    for (int i = 0; i < num_points; i++){
+        result[i] = std::make_pair(squaredL2(data.data() + i*DIM, query), i);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+Index<float, int>* buildIndex(SpaceInterface<float>* space, const std::vector<float>& data, int M){
+    int num_points = data.size() / DIM;
+    Index<float, int>* index = new Index<float, int>(space, num_points, M);
+    for (int label = 0; label < num_points; label++){
+        index->add((void*)(data.data() + label*DIM), label, 100);
+    }
+    return index;
+}
+
+// fraction of the true K nearest neighbors found by search
+double recall(Index<float, int>* index, const std::vector<float>& data, const std::vector<float>& queries, int K, int ef_search){
+    int num_queries = queries.size() / DIM;
+    double found = 0;
+    for (int q = 0; q < num_queries; q++){
+        const float* query = queries.data() + q*DIM;
+        std::vector< std::pair<float, int> > truth = bruteForce(data, query);
+        std::vector< std::pair<float, int> > results = index->search(query, K, ef_search);
+        for (auto& result : results){
+            for (int i = 0; i < K; i++){
+                if (result.second == truth[i].second){ found++; }
+            }
+        }
+    }
+    return found / (num_queries*K);
+}
+
+// number of nodes reachable from node 0
+int reachable(Index<float, int>* index){
+    std::vector< std::vector<unsigned int> > graph = index->graph();
+    std::vector<bool> reached(graph.size(), false);
+    std::vector<unsigned int> stack(1, 0);
+    reached[0] = true;
+    int count = 1;
+    while (!stack.empty()){
+        unsigned int node = stack.back();
+        stack.pop_back();
+        for (unsigned int neighbor : graph[node]){
+            if (!reached[neighbor]){
+                reached[neighbor] = true;
+                count++;
+                stack.push_back(neighbor);
+            }
+        }
+    }
+    return count;
+}
+
+// range_search (with radius between the 20th and 21st neighbor) against brute force
+void testRangeSearch(){
+    std::vector<float> data = randomData(2000, 1);
+    std::vector<float> queries = randomData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+
+    double found = 0;
+    double expected = 0;
+    for (int q = 0; q < 50; q++){
+        const float* query = queries.data() + q*DIM;
+        std::vector< std::pair<float, int> > truth = bruteForce(data, query);
+        float radius = (truth[19].first + truth[20].first) / 2;
+        std::vector< std::pair<float, int> > results = index->range_search(query, radius, 50);
+
+        std::vector<bool> seen(data.size() / DIM, false);
+        for (size_t i = 0; i < results.size(); i++){
+            CHECK(results[i].first <= radius);
+            CHECK(i == 0 || results[i-1].first <= results[i].first);
+            CHECK(!seen[results[i].second]);
+            seen[results[i].second] = true;
+        }
+        for (int i = 0; i < 20; i++){
+            found += seen[truth[i].second];
+        }
+        expected += 20;
+    }
+    CHECK(found / expected >= 0.95);
+    delete index;
+}
+
+// bulk_build on clustered data must reach every node and match the recall of add()
+void testBulkBuild(){
+    std::vector<float> data = clusteredData(5000, 1);
+    std::vector<float> queries = clusteredData(100, 2);
+    std::vector<int> labels(5000);
+    for (int i = 0; i < 5000; i++){
+        labels[i] = i;
+    }
+    L2Space space(DIM);
+    Index<float, int> index(&space, 5000, 16);
+    CHECK(index.bulk_build(data.data(), labels.data(), 5000, 100));
+    CHECK(index.size() == 5000);
+    CHECK(reachable(&index) == 5000);
+
+    Index<float, int>* incremental = buildIndex(&space, data, 16);
+    double bulk_recall = recall(&index, data, queries, 10, 50);
+    double incremental_recall = recall(incremental, data, queries, 10, 50);
+    CHECK(bulk_recall >= 0.9);
+    CHECK(bulk_recall >= incremental_recall - 0.03);
+    delete incremental;
+}
+
+// merging a delta index (with plain or compressed links) must give the recall of an index built over all of the data
+void testMerge(){
+    std::vector<float> data = randomData(4000, 1);
+    std::vector<float> queries = randomData(100, 2);
+    std::vector<float> main_data(data.begin(), data.begin() + 3000*DIM);
+    std::vector<float> delta_data(data.begin() + 3000*DIM, data.end());
+    L2Space space(DIM);
+    Index<float, int>* incremental = buildIndex(&space, data, 16);
+    double incremental_recall = recall(incremental, data, queries, 10, 50);
+    delete incremental;
+
+    for (int compressed = 0; compressed < 2; compressed++){
+        Index<float, int>* index = buildIndex(&space, main_data, 16);
+        Index<float, int>* delta = buildIndex(&space, delta_data, 16);
+        if (compressed){
+            delta->compress_links();
+        }
+        CHECK(index->merge(*delta, 100, 0, 3000));
+        CHECK(index->size() == 4000);
+        CHECK(reachable(index) == 4000);
+        double merged_recall = recall(index, data, queries, 10, 50);
+        CHECK(merged_recall >= 0.9);
+        CHECK(merged_recall >= incremental_recall - 0.03);
+        delete index;
+        delete delta;
+    }
+}
+
+// search results of every query, for comparing two indexes exactly
+std::vector< std::vector< std::pair<float, int> > > allResults(Index<float, int>* index, const std::vector<float>& queries){
+    int num_queries = queries.size() / DIM;
+    std::vector< std::vector< std::pair<float, int> > > results(num_queries);
+    for (int q = 0; q < num_queries; q++){
+        results[q] = index->search(queries.data() + q*DIM, 10, 50);
+    }
+    return results;
+}
+
+// sorted links of every node (compressed links are stored in sorted order)
+std::vector< std::vector<unsigned int> > sortedGraph(Index<float, int>* index){
+    std::vector< std::vector<unsigned int> > graph = index->graph();
+    for (std::vector<unsigned int>& links : graph){
+        std::sort(links.begin(), links.end());
+    }
+    return graph;
+}
+
+// compressed links must keep the links of every node, and must save and load (read or mapped) to the same index
+void testCompressSaveLoad(){
+    std::vector<float> data = randomData(3000, 1);
+    std::vector<float> queries = randomData(100, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    index->reorder(Index<float, int>::GraphOrder::GORDER);
+    std::vector< std::vector<unsigned int> > expected_graph = sortedGraph(index);
+
+    index->compress_links();
+    CHECK(sortedGraph(index) == expected_graph);
+    CHECK(recall(index, data, queries, 10, 50) >= 0.9);
+    std::vector< std::vector< std::pair<float, int> > > expected = allResults(index, queries);
+
+    std::string filename = "regression_tests_compressed.index";
+    index->save(filename);
+    delete index;
+    for (int use_mmap = 0; use_mmap < 2; use_mmap++){
+        Index<float, int> loaded(&space, filename, use_mmap);
+        CHECK(loaded.size() == 3000);
+        CHECK(allResults(&loaded, queries) == expected);
+        CHECK(sortedGraph(&loaded) == expected_graph);
+    }
+    std::remove(filename.c_str());
+}
+
+// Rewrites a saved index in the format from before the records had a degree field: M link slots per record,
+// with the unused ones padded with the node's own ID.
+void writePaddedFormat(const std::string& filename, const std::string& padded_filename){
+    std::ifstream in(filename, std::ios::binary);
+    size_t header[5]; // M, max_num_nodes, cur_num_nodes, data_size_bytes, record_size_bytes
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    size_t M = header[0];
+    size_t data_size_bytes = header[3];
+    size_t record_size_bytes = header[4];
+    size_t padded_size_bytes = record_size_bytes - sizeof(unsigned int);
+
+    std::ofstream out(padded_filename, std::ios::binary);
+    header[4] = padded_size_bytes;
+    out.write(reinterpret_cast<char*>(header), sizeof(header));
+    std::vector<char> record(record_size_bytes);
+    std::vector<char> padded(padded_size_bytes);
+    for (unsigned int node = 0; node < header[1]; node++){
+        in.read(record.data(), record_size_bytes);
+        unsigned int degree;
+        std::memcpy(&degree, record.data() + data_size_bytes, sizeof(unsigned int));
+        std::vector<unsigned int> links(M, node);
+        for (unsigned int i = 0; i < degree && node < header[2]; i++){
+            std::memcpy(&links[i], record.data() + data_size_bytes + (i+1)*sizeof(unsigned int), sizeof(unsigned int));
+        }
+        std::memcpy(padded.data(), record.data(), data_size_bytes);
+        std::memcpy(padded.data() + data_size_bytes, links.data(), M*sizeof(unsigned int));
+        std::memcpy(padded.data() + padded_size_bytes - sizeof(int), record.data() + record_size_bytes - sizeof(int), sizeof(int));
+        out.write(padded.data(), padded_size_bytes);
+    }
+    out<<in.rdbuf(); // router and hierarchy trailers
+}
+
+// files from before the degree field must load (read or mapped) to the same index
+void testLoadPaddedFormat(){
+    std::vector<float> data = randomData(3000, 1);
+    std::vector<float> queries = randomData(100, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    index->build_router(32);
+    std::vector< std::vector< std::pair<float, int> > > expected = allResults(index, queries);
+    std::vector< std::vector<unsigned int> > expected_graph = index->graph();
+    bool has_padding = false;
+    for (std::vector<unsigned int>& links : expected_graph){
+        has_padding = has_padding || links.size() < 16;
+    }
+    CHECK(has_padding);
+
+    std::string filename = "regression_tests.index";
+    std::string padded_filename = "regression_tests_padded.index";
+    index->save(filename);
+    delete index;
+    writePaddedFormat(filename, padded_filename);
+    for (int use_mmap = 0; use_mmap < 2; use_mmap++){
+        Index<float, int> loaded(&space, padded_filename, use_mmap);
+        CHECK(loaded.size() == 3000);
+        CHECK(loaded.router_size() == 32);
+        CHECK(loaded.graph() == expected_graph);
+        CHECK(allResults(&loaded, queries) == expected);
+    }
+    std::remove(filename.c_str());
+    std::remove(padded_filename.c_str());
+}
+
+// ShardedIndex::search_batch must return what search returns for each query, with good recall
+void testShardedSearch(){
+    std::vector<float> data = randomData(4000, 1);
+    std::vector<float> queries = randomData(100, 2);
+    std::vector<int> labels(4000);
+    for (int i = 0; i < 4000; i++){
+        labels[i] = i;
+    }
+    L2Space space(DIM);
+    ShardedIndex<float, int> index(&space, 4, 4000, 16);
+    index.add_batch(data.data(), labels.data(), 4000, 100, 4);
+    CHECK(index.size() == 4000);
+
+    std::vector< std::vector< std::pair<float, int> > > batch = index.search_batch(queries.data(), 100, 10, 50, 4);
+    CHECK(batch.size() == 100);
+    double found = 0;
+    for (int q = 0; q < 100; q++){
+        const float* query = queries.data() + q*DIM;
+        CHECK(batch[q] == index.search(query, 10, 50));
+        std::vector< std::pair<float, int> > truth = bruteForce(data, query);
+        for (auto& result : batch[q]){
+            for (int i = 0; i < 10; i++){
+                if (result.second == truth[i].second){ found++; }
+            }
+        }
+    }
+    CHECK(found / 1000 >= 0.9);
+}
+
+// builds, saves and loads an index with node_id_t IDs, which must give the results of the default 32-bit IDs
+template <typename node_id_t>
+void checkNodeIdType(){
+    std::vector<float> data = randomData(2000, 1);
+    std::vector<float> queries = randomData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* reference = buildIndex(&space, data, 16);
+    std::vector< std::vector< std::pair<float, int> > > expected = allResults(reference, queries);
+    delete reference;
+
+    Index<float, int, node_id_t> index(&space, (size_t)(2000), 16);
+    for (int label = 0; label < 2000; label++){
+        index.add((void*)(data.data() + label*DIM), label, 100);
+    }
+    CHECK(index.size() == 2000);
+    std::string filename = "regression_tests_node_id.index";
+    index.save(filename);
+    Index<float, int, node_id_t> loaded(&space, filename);
+    for (int q = 0; q < 50; q++){
+        std::vector< std::pair<float, int> > results = index.search(queries.data() + q*DIM, 10, 50);
+        CHECK(results == expected[q]);
+        CHECK(loaded.search(queries.data() + q*DIM, 10, 50) == expected[q]);
+    }
+
+    // the record size in the file tells load that the IDs have a different width
+    bool mismatch_thrown = false;
+    try {
+        Index<float, int> wrong(&space, filename);
+    } catch (const std::invalid_argument&){
+        mismatch_thrown = true;
+    }
+    CHECK(mismatch_thrown);
+    std::remove(filename.c_str());
+}
+
+void testNodeIdTypes(){
+    checkNodeIdType<uint16_t>();
+    checkNodeIdType<uint64_t>();
+
+    L2Space space(DIM);
+    bool overflow_thrown = false;
+    try {
+        Index<float, int, uint16_t> too_large(&space, (size_t)(1) << 16, 16);
+    } catch (const std::invalid_argument&){
+        overflow_thrown = true;
+    }
+    CHECK(overflow_thrown);
+}
+
+// the query cache must be emptied when reorder changes the graph, so hits always match a live search
+void testQueryCacheInvalidation(){
+    std::vector<float> data = randomData(2000, 1);
+    std::vector<float> queries = randomData(20, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    index->enable_query_cache(100);
+    QueryCache<float, int>* cache = index->get_query_cache();
+
+    // searches with stats always run, so they give the live results
+    Index<float, int>::SearchStats stats;
+    Index<float, int>::EarlyTermination termination;
+    for (int round = 0; round < 2; round++){
+        for (int q = 0; q < 20; q++){
+            index->search(queries.data() + q*DIM, 10, 20);
+        }
+    }
+    CHECK(cache->misses() == 20);
+    CHECK(cache->hits() == 20);
+
+    index->reorder(Index<float, int>::GraphOrder::RCM);
+    CHECK(cache->size() == 0);
+    for (int q = 0; q < 20; q++){
+        const float* query = queries.data() + q*DIM;
+        std::vector< std::pair<float, int> > cached = index->search(query, 10, 20);
+        CHECK(cached == index->search(query, 10, 20, 100, termination, &stats));
+    }
+    CHECK(cache->misses() == 40);
+    CHECK(cache->hits() == 20);
+    delete index;
+}
+
+double diskRecall(DiskIndex<int>& disk, const std::vector<float>& data, const std::vector<float>& queries, int K, int ef_search){
+    int num_queries = queries.size() / DIM;
+    double found = 0;
+    for (int q = 0; q < num_queries; q++){
+        const float* query = queries.data() + q*DIM;
+        std::vector< std::pair<float, int> > truth = bruteForce(data, query);
+        for (auto& result : disk.search(query, K, ef_search)){
+            for (int i = 0; i < K; i++){
+                if (result.second == truth[i].second){ found++; }
+            }
+        }
+    }
+    return found / (num_queries*K);
+}
+
+// DiskIndex on a saved index must find about as many true neighbors as the in-memory index, and a failed
+// read on an I/O thread must reach the caller as an exception
+void testDiskIndex(){
+    std::vector<float> data = randomData(3000, 1);
+    std::vector<float> queries = randomData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    double memory_recall = recall(index, data, queries, 10, 50);
+    std::string filename = "regression_tests_disk.index";
+    index->save(filename);
+    delete index;
+
+    for (int num_io_threads : {0, 2}){
+        DiskIndex<int> disk(&space, filename, 100, num_io_threads);
+        double disk_recall = diskRecall(disk, data, queries, 10, 50);
+        CHECK(disk_recall > 0.9);
+        CHECK(disk_recall > memory_recall - 0.05);
+    }
+
+    // cut the records off behind the open file, so the reads past the entry cache fail
+    DiskIndex<int> disk(&space, filename, 100, 2);
+    std::ifstream in(filename, std::ios::binary);
+    std::vector<char> header(4096);
+    in.read(header.data(), header.size());
+    in.close();
+    std::ofstream(filename, std::ios::binary | std::ios::trunc).write(header.data(), header.size());
+    bool read_error_thrown = false;
+    try {
+        disk.search(queries.data(), 10, 50);
+    } catch (const std::runtime_error&){
+        read_error_thrown = true;
+    }
+    CHECK(read_error_thrown);
+    std::remove(filename.c_str());
+}
+
+// An inner product space whose query context is the plain kernels followed by the negated query. The query
+// kernels only give the inner product distance if the index passes them the prepared context, not the query.
+class NegatedQuerySpace : public InnerProductSpace {
+    struct Header {
+        DistanceFunction<float> distance;
+        BatchDistanceFunction<float> batch_distance;
+    };
+
+    // the kernels in context, and the query restored from it
+    static Header restore(const void *context, float* query) {
+        Header header;
+        std::memcpy(&header, context, sizeof(header));
+        const float* negated = (const float*)((const char*)context + sizeof(header));
+        for (int i = 0; i < DIM; i++){
+            query[i] = -negated[i];
+        }
+        return header;
+    }
+
+    static float negatedQueryDistance(const void *context, const void *data, const void *qty_ptr) {
+        float query[DIM];
+        return restore(context, query).distance(query, data, qty_ptr);
+    }
+
+    static void negatedQueryBatchDistance(const void *context, const void *const *data, size_t n, float *out,
+                                          const void *qty_ptr) {
+        float query[DIM];
+        Header header = restore(context, query);
+        if (header.batch_distance != NULL){
+            header.batch_distance(query, data, n, out, qty_ptr);
+            return;
+        }
+        for (size_t i = 0; i < n; i++){
+            out[i] = header.distance(query, data[i], qty_ptr);
+        }
+    }
+
+public:
+    NegatedQuerySpace(size_t dim) : InnerProductSpace(dim) {}
+
+    size_t get_query_context_size() {
+        return sizeof(Header) + get_data_size();
+    }
+
+    void prepare_query(const void *query, void *context) {
+        Header header = {get_dist_func(), get_batch_dist_func()};
+        std::memcpy(context, &header, sizeof(header));
+        float* negated = (float*)((char*)context + sizeof(header));
+        for (int i = 0; i < DIM; i++){
+            negated[i] = -((const float*)query)[i];
+        }
+    }
+
+    DistanceFunction<float> get_query_dist_func() {
+        return negatedQueryDistance;
+    }
+
+    BatchDistanceFunction<float> get_query_batch_dist_func() {
+        return negatedQueryBatchDistance;
+    }
+};
+
+// a space with a query context must build the same graph and return the same results as its plain space
+void testQueryContext(){
+    std::vector<float> data = randomData(2000, 1);
+    std::vector<float> queries = randomData(50, 2);
+    InnerProductSpace plain_space(DIM);
+    NegatedQuerySpace context_space(DIM);
+    Index<float, int>* plain = buildIndex(&plain_space, data, 16);
+    Index<float, int>* prepared = buildIndex(&context_space, data, 16);
+
+    CHECK(plain->graph() == prepared->graph());
+    CHECK(allResults(plain, queries) == allResults(prepared, queries));
+
+    // a radius that holds about the 20 nearest neighbors of the first query
+    float radius = plain->search(queries.data(), 20, 50).back().first;
+    std::vector< std::pair<float, int> > range_results = prepared->range_search(queries.data(), radius, 50);
+    CHECK(!range_results.empty());
+    CHECK(range_results == plain->range_search(queries.data(), radius, 50));
+    delete plain;
+    delete prepared;
+}
+
+// distance from each query to the entry node, which the hierarchy picks when it is enabled
+std::vector<float> entryDistances(Index<float, int>* index, const std::vector<float>& queries){
+    int num_queries = queries.size() / DIM;
+    std::vector<float> distances(num_queries);
+    Index<float, int>::EarlyTermination termination;
+    for (int q = 0; q < num_queries; q++){
+        Index<float, int>::SearchStats stats;
+        index->search(queries.data() + q*DIM, 10, 50, 100, termination, &stats);
+        distances[q] = stats.entry_distance;
+    }
+    return distances;
+}
+
+// the hierarchy must survive a save and load, and reorder must relabel its layers along with the graph
+void testHierarchy(){
+    std::vector<float> data = clusteredData(3000, 1);
+    std::vector<float> queries = clusteredData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    index->enable_hierarchy();
+    size_t levels = index->hierarchy_levels();
+    CHECK(levels > 0);
+    CHECK(recall(index, data, queries, 10, 50) >= 0.9);
+    std::vector< std::vector< std::pair<float, int> > > expected = allResults(index, queries);
+    std::vector<float> expected_entries = entryDistances(index, queries);
+
+    std::string filename = "regression_tests_hierarchy.index";
+    index->save(filename);
+    delete index;
+    Index<float, int> loaded(&space, filename);
+    std::remove(filename.c_str());
+    CHECK(loaded.hierarchy_levels() == levels);
+    CHECK(allResults(&loaded, queries) == expected);
+    CHECK(entryDistances(&loaded, queries) == expected_entries);
+
+    loaded.reorder(Index<float, int>::GraphOrder::RCM);
+    CHECK(loaded.hierarchy_levels() == levels);
+    CHECK(allResults(&loaded, queries) == expected);
+    CHECK(entryDistances(&loaded, queries) == expected_entries);
+}
+
+// the router must survive a save and load, and reorder must relabel its entry points along with the graph
+void testRouter(){
+    std::vector<float> data = clusteredData(3000, 1);
+    std::vector<float> queries = clusteredData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    index->build_router(64);
+    CHECK(index->router_size() == 64);
+    CHECK(recall(index, data, queries, 10, 50) >= 0.9);
+    std::vector< std::vector< std::pair<float, int> > > expected = allResults(index, queries);
+    std::vector<float> expected_entries = entryDistances(index, queries);
+
+    std::string filename = "regression_tests_router.index";
+    index->save(filename);
+    delete index;
+    Index<float, int> loaded(&space, filename);
+    std::remove(filename.c_str());
+    CHECK(loaded.router_size() == 64);
+    CHECK(allResults(&loaded, queries) == expected);
+    CHECK(entryDistances(&loaded, queries) == expected_entries);
+
+    // the router keeps its own copy of the entry vectors, so only the distance to the node they lead to shows
+    // whether its node IDs were relabeled
+    loaded.reorder(Index<float, int>::GraphOrder::RCM);
+    CHECK(loaded.router_size() == 64);
+    CHECK(allResults(&loaded, queries) == expected);
+    CHECK(entryDistances(&loaded, queries) == expected_entries);
+}
+
+// refine must not lower the recall of a cheap build, whichever n_initializations it uses
+void testRefine(){
+    std::vector<float> data = clusteredData(3000, 1);
+    std::vector<float> queries = clusteredData(50, 2);
+    L2Space space(DIM);
+    for (int n_initializations : {100, 10}){
+        Index<float, int> index(&space, 3000, 16);
+        for (int label = 0; label < 3000; label++){
+            index.add((void*)(data.data() + label*DIM), label, 10);
+        }
+        double cheap_recall = recall(&index, data, queries, 10, 10);
+        index.refine(1, 100, 0, n_initializations);
+        CHECK(recall(&index, data, queries, 10, 10) >= cheap_recall);
+        CHECK(reachable(&index) == 3000);
+    }
+}
+
+// Early termination must cut the distance computations of a large-ef search while its results stay sorted,
+// with their true distances and a recall of at least 0.9. patience 0 turns it off.
+void testEarlyTermination(){
+    std::vector<float> data = clusteredData(3000, 1);
+    std::vector<float> queries = clusteredData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    Index<float, int>::EarlyTermination off;
+    std::vector<Index<float, int>::EarlyTermination> terminations = {
+        Index<float, int>::EarlyTermination(5), Index<float, int>::EarlyTermination(5, 0.01)};
+
+    size_t full_computations = 0;
+    for (int q = 0; q < 50; q++){
+        const float* query = queries.data() + q*DIM;
+        Index<float, int>::SearchStats stats;
+        std::vector< std::pair<float, int> > results = index->search(query, 10, 200, 100, off, &stats);
+        CHECK(results == index->search(query, 10, 200));
+        full_computations += stats.distance_computations;
+    }
+
+    for (Index<float, int>::EarlyTermination& termination : terminations){
+        size_t computations = 0;
+        double found = 0;
+        for (int q = 0; q < 50; q++){
+            const float* query = queries.data() + q*DIM;
+            Index<float, int>::SearchStats stats;
+            std::vector< std::pair<float, int> > results = index->search(query, 10, 200, 100, termination, &stats);
+            computations += stats.distance_computations;
+            CHECK(results == index->search(query, 10, 200, 100, termination));
+            CHECK(results.size() == 10);
+            for (size_t i = 0; i < results.size(); i++){
+                float distance = squaredL2(data.data() + results[i].second*DIM, query);
+                CHECK(std::fabs(results[i].first - distance) <= 1e-5 * std::max(distance, 1.0f));
+                if (i > 0){ CHECK(results[i-1].first <= results[i].first); }
+            }
+            std::vector< std::pair<float, int> > truth = bruteForce(data, query);
+            for (auto& result : results){
+                for (int i = 0; i < 10; i++){
+                    if (result.second == truth[i].second){ found++; }
+                }
+            }
+        }
+        CHECK(computations < full_computations * 0.8);
+        CHECK(found / 500 >= 0.9);
+    }
+    delete index;
+}
+
+// The stats of a search must be non-zero and consistent with each other and with its results. Every visited
+// node has its distance computed once, plus the 100 strided candidates of searchInitialization (3000 / 30).
+void testSearchStats(){
+    std::vector<float> data = randomData(3000, 1);
+    std::vector<float> queries = randomData(50, 2);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    Index<float, int>::EarlyTermination termination;
+    for (int q = 0; q < 50; q++){
+        const float* query = queries.data() + q*DIM;
+        Index<float, int>::SearchStats stats;
+        std::vector< std::pair<float, int> > results = index->search(query, 10, 50, 100, termination, &stats);
+        CHECK(results == index->search(query, 10, 50));
+        CHECK(stats.hops > 0);
+        CHECK(stats.visited_inserts >= stats.hops);
+        CHECK(stats.visited_inserts >= 50);
+        CHECK(stats.distance_computations == stats.visited_inserts + 100);
+        CHECK(stats.entry_distance >= results[0].first);
+        CHECK(stats.final_distance >= results.back().first);
+        CHECK(stats.initialization_ns > 0);
+    }
+    delete index;
+}
+
+// A query and KERNEL_BATCH vectors of dimension dim, for comparing distance kernels. 7 vectors go through both
+// the 4-vector and the 1-vector paths of the batch kernels.
+static const size_t KERNEL_BATCH = 7;
+
+struct KernelInputs {
+    size_t dim;
+    std::vector<float> query;
+    std::vector<float> vectors;
+    std::vector<const void*> pointers;
+
+    KernelInputs(size_t _dim, int seed): dim(_dim), query(_dim), vectors(KERNEL_BATCH*_dim), pointers(KERNEL_BATCH) {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> uniform(-1, 1);
+        for (float& x : query){ x = uniform(rng); }
+        for (float& x : vectors){ x = uniform(rng); }
+        for (size_t i = 0; i < KERNEL_BATCH; i++){
+            pointers[i] = vectors.data() + i*dim;
+        }
+    }
+
+    // error of distance for vector i, relative to the scalar kernel and the magnitude of its sum
+    double error(bool inner_product, size_t i, float distance){
+        const float* v = vectors.data() + i*dim;
+        double magnitude = inner_product ? 1 : 0;
+        for (size_t j = 0; j < dim; j++){
+            magnitude += inner_product ? std::fabs(query[j] * v[j]) : (query[j] - v[j]) * (query[j] - v[j]);
+        }
+        float scalar = inner_product ? InnerProduct(query.data(), v, &dim) : L2Sqr(query.data(), v, &dim);
+        return std::fabs((double)distance - scalar) / magnitude;
+    }
+};
+
+// largest error of the distance and batch kernels of a runtime space
+double runtimeKernelError(SpaceInterface<float>* space, bool inner_product, size_t dim){
+    KernelInputs inputs(dim, dim);
+    DistanceFunction<float> distance = space->get_dist_func();
+    BatchDistanceFunction<float> batch_distance = space->get_batch_dist_func();
+    float out[KERNEL_BATCH];
+    if (batch_distance != NULL){
+        batch_distance(inputs.query.data(), inputs.pointers.data(), KERNEL_BATCH, out, &dim);
+    }
+    double max_error = 0;
+    for (size_t i = 0; i < KERNEL_BATCH; i++){
+        max_error = std::max(max_error, inputs.error(inner_product, i, distance(inputs.query.data(), inputs.pointers[i], &dim)));
+        if (batch_distance != NULL){
+            max_error = std::max(max_error, inputs.error(inner_product, i, out[i]));
+        }
+    }
+    return max_error;
+}
+
+// largest error of the distance and batch kernels of FixedFloatSpace<inner_product, DIM>
+template <bool inner_product, size_t DIM>
+double fixedKernelError(){
+    KernelInputs inputs(DIM, DIM);
+    float out[KERNEL_BATCH];
+    FixedFloatSpace<inner_product, DIM>::batch(inputs.query.data(), inputs.pointers.data(), KERNEL_BATCH, out);
+    double max_error = 0;
+    for (size_t i = 0; i < KERNEL_BATCH; i++){
+        float distance = FixedFloatSpace<inner_product, DIM>::distance(inputs.query.data(), inputs.pointers[i]);
+        max_error = std::max(max_error, inputs.error(inner_product, i, distance));
+        max_error = std::max(max_error, inputs.error(inner_product, i, out[i]));
+    }
+    return max_error;
+}
+
+template <size_t... DIMS>
+double fixedKernelErrors(){
+    double max_error = 0;
+    for (double error : {fixedKernelError<false, DIMS>()..., fixedKernelError<true, DIMS>()...}){
+        max_error = std::max(max_error, error);
+    }
+    return max_error;
+}
+
+// The SIMD kernels (single, batched and fixed-dimension) must compute the same distances as the scalar kernels,
+// up to float rounding, including the tails of dimensions that are not a multiple of the SIMD width.
+void testDistanceKernels(){
+    std::vector<size_t> dims;
+    for (size_t dim = 1; dim <= 130; dim++){ dims.push_back(dim); }
+    dims.push_back(768);
+    dims.push_back(960);
+    double max_error = 0;
+    for (size_t dim : dims){
+        L2Space l2_space(dim);
+        InnerProductSpace inner_product_space(dim);
+        max_error = std::max(max_error, runtimeKernelError(&l2_space, false, dim));
+        max_error = std::max(max_error, runtimeKernelError(&inner_product_space, true, dim));
+    }
+    CHECK(max_error <= 5e-6);
+    CHECK((fixedKernelErrors<1, 3, 4, 5, 7, 8, 12, 15, 16, 17, 31, 33, 96, 100, 128, 130, 768, 960>() <= 5e-6));
+}
+
+// copies must own a copy of the table, and move assignment must take over the other table (and free its own,
+// which only shows up as a leak, e.g. under -fsanitize=address)
+void testExplicitSet(){
+    // a new set holds every element until the first clear, as beamSearch always clears before it searches
+    ExplicitSet set(100);
+    set.clear();
+    set.insert(3);
+    set.insert(42);
+
+    ExplicitSet copy(set);
+    CHECK(copy[3] && copy[42] && !copy[4]);
+    copy.insert(4);
+    CHECK(!set[4]);
+
+    ExplicitSet moved(10);
+    moved = std::move(copy);
+    CHECK(moved[3] && moved[4] && moved[42] && !moved[5]);
+
+    ExplicitSet assigned(10);
+    assigned = set;
+    CHECK(assigned[3] && assigned[42] && !assigned[4]);
+    assigned.clear();
+    CHECK(!assigned[3] && set[3]);
+}
+
+// connected must report a graph that is split in two, and refine must link the halves back together
+void testConnected(){
+    std::vector<float> data = clusteredData(3000, 1);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    CHECK(index->connected());
+
+    std::vector< std::vector<unsigned int> > graph = index->graph();
+    for (unsigned int node = 0; node < 3000; node++){
+        std::vector<unsigned int> same_half;
+        for (unsigned int link : graph[node]){
+            if ((link < 1500) == (node < 1500)){ same_half.push_back(link); }
+        }
+        graph[node] = same_half;
+    }
+    index->flash(graph);
+    CHECK(!index->connected());
+    CHECK(reachable(index) <= 1500);
+
+    index->refine(1, 100);
+    CHECK(index->connected());
+    CHECK(reachable(index) == 3000);
+    index->compress_links();
+    CHECK(index->connected());
+    delete index;
+}
+
+// profile_reorder on several threads (each profiling search borrows a visited set from the pool) must only
+// relabel the graph. The strided entry points change with the node IDs, so recall is compared, not results.
+void testProfileReorder(){
+    std::vector<float> data = clusteredData(3000, 1);
+    std::vector<float> queries = clusteredData(50, 2);
+    std::vector<float> profile_queries = clusteredData(200, 3);
+    L2Space space(DIM);
+    Index<float, int>* index = buildIndex(&space, data, 16);
+    double expected_recall = recall(index, data, queries, 10, 50);
+    index->profile_reorder(profile_queries.data(), 200, 50, Index<float, int>::ProfileOrder::GORDER, 4);
+    CHECK(recall(index, data, queries, 10, 50) >= expected_recall - 0.02);
+    index->profile_reorder(profile_queries.data(), 200, 50, Index<float, int>::ProfileOrder::RCM, 4);
+    CHECK(recall(index, data, queries, 10, 50) >= expected_recall - 0.02);
+    CHECK(reachable(index) == 3000);
+    delete index;
+}
+
+// the compressed link offsets are relative to blocks of 65536 nodes, so the graph must decode the same across them
+void testCompressBlocks(){
+    std::vector<float> data = randomData(70000, 1);
+    L2Space space(DIM);
+    Index<float, int> index(&space, 70000, 8);
+    for (int label = 0; label < 70000; label++){
+        index.add((void*)(data.data() + label*DIM), label, 20);
+    }
+    std::vector< std::vector<unsigned int> > expected_graph = sortedGraph(&index);
+    size_t uncompressed_bytes = index.link_memory_bytes();
+    index.compress_links();
+    CHECK(index.link_memory_bytes() < uncompressed_bytes);
+    CHECK(sortedGraph(&index) == expected_graph);
+    index.decompress_links();
+    CHECK(sortedGraph(&index) == expected_graph);
+}
+
+int main(int argc, char **argv){
+
+    std::vector< std::pair<std::string, void(*)()> > tests = {
+        {"range_search", testRangeSearch},
+        {"bulk_build", testBulkBuild},
+        {"merge", testMerge},
+        {"compress_save_load", testCompressSaveLoad},
+        {"load_padded_format", testLoadPaddedFormat},
+        {"sharded_search", testShardedSearch},
+        {"node_id_types", testNodeIdTypes},
+        {"query_cache_invalidation", testQueryCacheInvalidation},
+        {"disk_index", testDiskIndex},
+        {"query_context", testQueryContext},
+        {"hierarchy", testHierarchy},
+        {"router", testRouter},
+        {"refine", testRefine},
+        {"early_termination", testEarlyTermination},
+        {"search_stats", testSearchStats},
+        {"distance_kernels", testDistanceKernels},
+        {"explicit_set", testExplicitSet},
+        {"connected", testConnected},
+        {"profile_reorder", testProfileReorder},
+        {"compress_blocks", testCompressBlocks},
+    };
+
+    int num_run = 0;
+    for (auto& test : tests){
+        if (argc > 1 && test.first != argv[1]){
+            continue;
+        }
+        std::clog<<"Running "<<test.first<<std::endl;
+        test.second();
+        num_run++;
+    }
+    if (num_run == 0){
+        std::cerr<<"Unknown test: "<<argv[1]<<std::endl;
+        return -1;
+    }
+    if (failures > 0){
+        std::cerr<<failures<<" checks failed"<<std::endl;
+        return 1;
+    }
+    return 0;
+}
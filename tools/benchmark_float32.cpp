@@ -0,0 +1,433 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <utility>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "../flatnav/Index.h"
+#include "../flatnav/NumaIndex.h"
+#include <algorithm>
+#include <string>
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+// Pins the calling thread to a single core. Returns false if pinning is not supported or fails.
+bool pin_to_core(int core){
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core % std::thread::hardware_concurrency(), &cpuset);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0);
+#else
+    return false;
+#endif
+}
+
+// Nearest-rank percentile of a sorted list of latencies.
+double percentile(const std::vector<double>& sorted_latencies, double p){
+    if (sorted_latencies.empty()){ return 0; }
+    size_t rank = (size_t)(std::ceil(p / 100.0 * sorted_latencies.size()));
+    if (rank < 1){ rank = 1; }
+    if (rank > sorted_latencies.size()){ rank = sorted_latencies.size(); }
+    return sorted_latencies[rank - 1];
+}
+
+struct BenchmarkResult {
+    int num_threads;
+    int ef_search;
+    double recall;
+    double qps;
+    double mean_us;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double p999_us;
+};
+
+// Loads the index through dispatch_fixed_space (see Index.h), so that it searches with the fixed-dimension distance
+// kernels if there are any for the space. The search is wrapped in a std::function, which costs one indirect call per
+// query rather than one per distance.
+struct FixedIndexLoader {
+    SpaceInterface<float>* space;
+    std::string filename;
+    int k;
+    int cache_capacity;
+    float cache_epsilon;
+    std::shared_ptr<void> index;
+    QueryCache<float, int>* query_cache;
+    std::function<std::vector<std::pair<float, int> >(const void*, int)> search;
+
+    template <typename IndexType>
+    void run(){
+        std::shared_ptr<IndexType> loaded(new IndexType(space, filename));
+        if (cache_capacity > 0){
+            loaded->enable_query_cache(cache_capacity, cache_epsilon);
+        }
+        query_cache = loaded->get_query_cache();
+        int num_results = k;
+        search = [loaded, num_results](const void* q, int ef_search){ return loaded->search(q, num_results, ef_search); };
+        index = loaded;
+    }
+};
+
+
+int main(int argc, char **argv){
+
+    if (argc < 7){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"benchmark <index> <space> <queries> <gtruth> <ef_search> <k>";
+        std::clog<<" [--nq num_queries] [--threads num_threads] [--warmup num_warmup] [--no_pin] [--numa placement] [--cache capacity] [--cache_epsilon epsilon] [--fixed] [--format format] [--out outfile]"<<std::endl;
+        std::clog<<"Positional arguments:"<<std::endl;
+        std::clog<<"\t index: Filename for input index (float32 index)."<<std::endl;
+        std::clog<<"\t space: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
+        std::clog<<"\t queries: Filename for queries (float32 file)."<<std::endl;
+        std::clog<<"\t gtruth: Filename for ground truth (int32 file)."<<std::endl;
+        std::clog<<"\t ef_search: CSV list of int,int,int...,int ef_search parameters."<<std::endl;
+        std::clog<<"\t k: Number of neighbors to return."<<std::endl;
+
+        std::clog<<"Optional arguments:"<<std::endl;
+        std::clog<<"\t [--nq num_queries]: (Optional, default 0) Number of queries to use. If 0, uses all queries."<<std::endl;
+        std::clog<<"\t [--threads num_threads]: (Optional, default 1,2,4,...,#cores) CSV list of thread counts to benchmark."<<std::endl;
+        std::clog<<"\t [--warmup num_warmup]: (Optional, default 1000) Number of untimed queries to run before each measurement."<<std::endl;
+        std::clog<<"\t [--no_pin]: (Optional) Do not pin search threads to cores."<<std::endl;
+        std::clog<<"\t [--numa placement]: (Optional, default none) NUMA placement of the index: none, interleave (spread one copy across nodes) or replicate (one copy per node, searched by the threads on that node). Requires libnuma."<<std::endl;
+        std::clog<<"\t [--cache capacity]: (Optional, default 0) Cache up to this many search results. The warmup queries repeat the query set, so with a large enough cache every timed query is a hit. If 0, no cache."<<std::endl;
+        std::clog<<"\t [--cache_epsilon epsilon]: (Optional, default 0) Let queries within epsilon in every coordinate share cached results."<<std::endl;
+        std::clog<<"\t [--fixed]: (Optional) Search with the fixed-dimension distance kernels (L2FixedSpace, InnerProductFixedSpace) if there are any for this dimension."<<std::endl;
+        std::clog<<"\t [--format format]: (Optional, default csv) Output format: csv or json."<<std::endl;
+        std::clog<<"\t [--out outfile]: (Optional) Write results to this file instead of stdout."<<std::endl;
+        return -1;
+    }
+
+    // Optional arguments.
+    int num_queries = 0;
+    std::vector<int> thread_counts;
+    int num_warmup = 1000;
+    bool pin_threads = true;
+    std::string numa_placement("none");
+    int cache_capacity = 0;
+    float cache_epsilon = 0;
+    bool use_fixed = false;
+    std::string format("csv");
+    std::string outfilename;
+
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--nq",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_queries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --nq"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                std::stringstream ts(argv[i+1]);
+                int element = 0;
+                while(ts >> element){
+                    thread_counts.push_back(element);
+                    if (ts.peek() == ',') ts.ignore();
+                }
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --threads"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--warmup",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_warmup = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --warmup"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--no_pin",argv[i]) == 0){
+            pin_threads = false;
+        }
+        if (std::strcmp("--fixed",argv[i]) == 0){
+            use_fixed = true;
+        }
+        if (std::strcmp("--numa",argv[i]) == 0){
+            if ((i+1) < argc){
+                numa_placement = std::string(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --numa"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--cache",argv[i]) == 0){
+            if ((i+1) < argc){
+                cache_capacity = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --cache"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--cache_epsilon",argv[i]) == 0){
+            if ((i+1) < argc){
+                cache_epsilon = std::stof(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --cache_epsilon"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--format",argv[i]) == 0){
+            if ((i+1) < argc){
+                format = std::string(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --format"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--out",argv[i]) == 0){
+            if ((i+1) < argc){
+                outfilename = std::string(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --out"<<std::endl;
+                return -1;
+            }
+        }
+    }
+    if (cache_capacity > 0 && numa_placement != "none"){
+        std::cerr<<"Invalid arguments: --cache cannot be combined with --numa."<<std::endl;
+        return -1;
+    }
+    if (use_fixed && numa_placement != "none"){
+        std::cerr<<"Invalid arguments: --fixed cannot be combined with --numa."<<std::endl;
+        return -1;
+    }
+    if (numa_placement != "none" && numa_placement != "interleave" && numa_placement != "replicate"){
+        std::cerr<<"Invalid argument for optional parameter --numa: Must be none, interleave or replicate."<<std::endl;
+        return -1;
+    }
+    if (format != "csv" && format != "json"){
+        std::cerr<<"Invalid argument for optional parameter --format: Must be csv or json."<<std::endl;
+        return -1;
+    }
+    if (thread_counts.empty()){
+        int max_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int t = 1; t < max_threads; t *= 2){
+            thread_counts.push_back(t);
+        }
+        thread_counts.push_back(max_threads);
+    }
+
+    // Positional arguments.
+    std::string indexfilename(argv[1]);  // Index filename.
+    int space_ID = std::stoi(argv[2]); // Space ID for querying.
+
+    // Load queries.
+    std::ifstream querystream(argv[3], std::ios::binary);
+    unsigned int dim;
+    unsigned int num_queries_check;
+    querystream.read((char*)&num_queries_check, 4);
+    querystream.read((char*)&dim, 4);
+    if (num_queries == 0){ // If nq not specified, use all queries.
+        num_queries = num_queries_check;
+    }
+    std::clog<<"Reading "<<num_queries<<" queries of "<<num_queries_check<<" total queries of dimension "<<dim<<"."<<std::endl;
+    if (num_queries_check != num_queries){std::clog<<"Warning: Using only "<< num_queries << " points of total "<< num_queries_check <<"."<<std::endl;}
+    // Allocate and load the queries into RAM.
+    float* queries = new float[num_queries * dim];
+    for (size_t i = 0; i < num_queries; i++){
+        querystream.read((char*)(queries + dim*i), 4*dim);
+    }
+    querystream.close();
+    std::clog<<"Read "<<num_queries<<" queries into RAM."<<std::endl;
+
+    // Load ground truth.
+    std::ifstream truthstream(argv[4], std::ios::binary);
+    int num_gtruth_lists;
+    int num_gtruth_entries;
+    truthstream.read((char*)&num_gtruth_lists, 4);
+    truthstream.read((char*)&num_gtruth_entries, 4);
+    std::clog<<"Reading "<<num_gtruth_lists<<" ground truth lists of "<<num_gtruth_entries<<" results."<<std::endl;
+    if (num_gtruth_lists < num_queries){
+        std::cerr<<"Error: Need at least "<<num_queries<<" gtruth lists."<<std::endl;
+        return -1;
+    }
+    unsigned int* gtruth = new unsigned int[num_gtruth_lists * num_gtruth_entries];
+    for (size_t i = 0; i < num_gtruth_lists; i++){
+        truthstream.read((char*)(gtruth + num_gtruth_entries*i), num_gtruth_entries * 4);
+    }
+    truthstream.close();
+    std::clog<<"Read "<<num_gtruth_lists<<" gtruth vectors into RAM."<<std::endl;
+
+    // EF search vector.
+    std::vector<int> ef_searches;
+    std::stringstream ss(argv[5]);
+    int element = 0;
+    while(ss >> element){
+        ef_searches.push_back(element);
+        if (ss.peek() == ',') ss.ignore();
+    }
+    // Number of search results.
+    int k = std::stoi(argv[6]);
+    if (k > num_gtruth_entries){
+        std::cerr<<"K is larger than the number of precomputed ground truth neighbors."<<std::endl;
+        return -1;
+    }
+
+    // Load the index from disk.
+    SpaceInterface<float>* space;
+    if (space_ID == 0){
+        space = new L2Space(dim);
+    } else {
+        space = new InnerProductSpace(dim);
+    }
+    std::clog<<"Loading index from "<<indexfilename<<std::endl;
+    Index<float, int>* index = NULL;
+    NumaIndex<float, int>* numa_index = NULL;
+    QueryCache<float, int>* query_cache = NULL;
+    FixedIndexLoader fixed = {space, indexfilename, k, cache_capacity, cache_epsilon};
+    if (use_fixed){
+        if (dispatch_fixed_space<int>(space, fixed)){
+            std::clog<<"Using the fixed-dimension kernels for dimension "<<dim<<"."<<std::endl;
+        } else {
+            std::clog<<"Warning: No fixed-dimension kernels for dimension "<<dim<<", using the runtime kernels."<<std::endl;
+        }
+        query_cache = fixed.query_cache;
+    } else if (numa_placement == "none"){
+        index = new Index<float, int>(space, indexfilename);
+        if (cache_capacity > 0){
+            index->enable_query_cache(cache_capacity, cache_epsilon);
+        }
+        query_cache = index->get_query_cache();
+    } else {
+        numa_index = new NumaIndex<float, int>(space, indexfilename, (numa_placement == "interleave") ?
+            NumaIndex<float, int>::Placement::INTERLEAVE : NumaIndex<float, int>::Placement::REPLICATE);
+        std::clog<<"Loaded "<<numa_index->num_replicas()<<" NUMA replica(s)."<<std::endl;
+    }
+    auto search = [&](const void* q, int ef_search){
+        return use_fixed ? fixed.search(q, ef_search) :
+            (numa_index != NULL) ? numa_index->search(q, k, ef_search) : index->search(q, k, ef_search);
+    };
+
+    std::vector<BenchmarkResult> results;
+    std::vector<double> latencies_ns(num_queries);
+    std::vector<double> recalls(num_queries);
+
+    for (int num_threads : thread_counts){
+        for (int ef_search : ef_searches){
+            std::clog<<"Running "<<num_threads<<" threads with ef_search = "<<ef_search<<std::endl;
+
+            // Each thread pulls queries from a shared counter until all of them are done. The first
+            // num_warmup queries (taken round-robin from the query set) are run untimed to warm the caches.
+            std::atomic<int> next_warmup(0);
+            std::atomic<int> next_query(0);
+            std::chrono::steady_clock::time_point start_q;
+            std::atomic<int> num_ready(0);
+            std::atomic<bool> go(false);
+
+            auto worker = [&](int thread_id){
+                if (pin_threads){ pin_to_core(thread_id); }
+                for (int w = next_warmup++; w < num_warmup; w = next_warmup++){
+                    search(queries + dim*(w % num_queries), ef_search);
+                }
+                // barrier: the timed section starts once every thread has finished warming up
+                num_ready++;
+                while (!go.load()){ std::this_thread::yield(); }
+
+                for (int i = next_query++; i < num_queries; i = next_query++){
+                    float* q = queries + dim*i;
+                    unsigned int* g = gtruth + num_gtruth_entries*i;
+
+                    auto start = std::chrono::steady_clock::now();
+                    std::vector<std::pair<float, int> > result = search(q, ef_search);
+                    auto stop = std::chrono::steady_clock::now();
+                    latencies_ns[i] = std::chrono::duration<double, std::nano>(stop - start).count();
+
+                    double recall = 0;
+                    for (int j = 0; j < k && j < result.size(); j++){
+                        for (int l = 0; l < k; l++){
+                            if (result[j].second == g[l]){
+                                recall = recall + 1;
+                            }
+                        }
+                    }
+                    recalls[i] = recall / k;
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++){
+                threads.emplace_back(worker, t);
+            }
+            while (num_ready.load() < num_threads){ std::this_thread::yield(); }
+            start_q = std::chrono::steady_clock::now();
+            go = true;
+            for (std::thread& thread : threads){
+                thread.join();
+            }
+            auto stop_q = std::chrono::steady_clock::now();
+            double wall_seconds = std::chrono::duration<double>(stop_q - start_q).count();
+
+            if (query_cache != NULL){
+                std::clog<<"Query cache: "<<query_cache->hits()<<" hits, "<<query_cache->misses()<<" misses"<<std::endl;
+                query_cache->reset_counters();
+            }
+
+            BenchmarkResult r;
+            r.num_threads = num_threads;
+            r.ef_search = ef_search;
+            r.recall = 0;
+            r.mean_us = 0;
+            for (int i = 0; i < num_queries; i++){
+                r.recall += recalls[i];
+                r.mean_us += latencies_ns[i];
+            }
+            r.recall = r.recall / num_queries;
+            r.mean_us = r.mean_us / num_queries / 1000.0;
+            r.qps = num_queries / wall_seconds;
+
+            std::vector<double> sorted_latencies(latencies_ns);
+            std::sort(sorted_latencies.begin(), sorted_latencies.end());
+            r.p50_us = percentile(sorted_latencies, 50) / 1000.0;
+            r.p90_us = percentile(sorted_latencies, 90) / 1000.0;
+            r.p99_us = percentile(sorted_latencies, 99) / 1000.0;
+            r.p999_us = percentile(sorted_latencies, 99.9) / 1000.0;
+            results.push_back(r);
+        }
+    }
+
+    std::ofstream outfile;
+    if (!outfilename.empty()){
+        outfile.open(outfilename);
+    }
+    std::ostream& out = outfilename.empty() ? std::cout : outfile;
+
+    if (format == "csv"){
+        out<<"threads,ef_search,recall,qps,mean_us,p50_us,p90_us,p99_us,p999_us"<<std::endl;
+        for (const BenchmarkResult& r : results){
+            out<<r.num_threads<<","<<r.ef_search<<","<<r.recall<<","<<r.qps<<","<<r.mean_us<<",";
+            out<<r.p50_us<<","<<r.p90_us<<","<<r.p99_us<<","<<r.p999_us<<std::endl;
+        }
+    } else {
+        out<<"["<<std::endl;
+        for (size_t i = 0; i < results.size(); i++){
+            const BenchmarkResult& r = results[i];
+            out<<"  {\"threads\": "<<r.num_threads<<", \"ef_search\": "<<r.ef_search<<", \"recall\": "<<r.recall;
+            out<<", \"qps\": "<<r.qps<<", \"mean_us\": "<<r.mean_us<<", \"p50_us\": "<<r.p50_us;
+            out<<", \"p90_us\": "<<r.p90_us<<", \"p99_us\": "<<r.p99_us<<", \"p999_us\": "<<r.p999_us<<"}";
+            out<<((i + 1 < results.size()) ? "," : "")<<std::endl;
+        }
+        out<<"]"<<std::endl;
+    }
+
+    delete index;
+    delete numa_index;
+    delete[] queries;
+    delete[] gtruth;
+    return 0;
+}
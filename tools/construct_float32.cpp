@@ -7,8 +7,10 @@
 #include <utility>
 
 #include "../flatnav/Index.h"
+#include "../flatnav/PerfCounters.h"
 #include <algorithm>
 #include <string>
+#include <cstring>
 
 
 int main(int argc, char **argv){
@@ -16,7 +18,7 @@ int main(int argc, char **argv){
     if (argc < 4){
         std::clog<<"Usage: "<<std::endl; 
         std::clog<<"construct_float32 <data> <space> <outfile>";
-        std::clog<<" [--N num_vectors] [--M num_links] [--ef ef_construction] [--verbose num_verbose]"<<std::endl;
+        std::clog<<" [--N num_vectors] [--M num_links] [--ef ef_construction] [--verbose num_verbose] [--perf] [--router num_entries] [--hierarchy] [--bulk num_threads] [--refine iterations] [--refine_ef ef_refine]"<<std::endl;
 
         std::clog<<"Positional arguments: "<<std::endl;
         std::clog<<"\t data: Filename pointing to an fvecs file (4 byte uint N, 4 byte uint dim, then list of 32-bit little-endian floats)."<<std::endl;
@@ -28,6 +30,12 @@ int main(int argc, char **argv){
         std::clog<<"\t [--M num_links]: (Optional, default 8) Max number of links per node."<<std::endl;
         std::clog<<"\t [--ef ef_construction]: (Optional, default 400) Search parameter used for construction."<<std::endl;
         std::clog<<"\t [--verbose num_verbose]: (Optional, default 100000) Number of vectors for progress bar. If zero, no progress bar."<<std::endl;
+        std::clog<<"\t [--perf]: (Optional) Measure hardware performance counters (cycles, instructions, L1D/LLC/dTLB misses) per insert. With --bulk, this counts the work of all of the build threads. Linux only."<<std::endl;
+        std::clog<<"\t [--router num_entries]: (Optional, default 0) Build an entry point router with this many entries and save it with the index. It replaces the strided entry point search at query time."<<std::endl;
+        std::clog<<"\t [--hierarchy]: (Optional) Build HNSW-style upper layers during construction and save them with the index. They pick the entry node for each search, in place of the router or the strided entry point search."<<std::endl;
+        std::clog<<"\t [--bulk num_threads]: (Optional) Build the whole graph at once with parallel NN-descent (see Index::bulk_build) instead of inserting one vector at a time. If num_threads is 0, uses all cores. Reads the whole dataset into memory."<<std::endl;
+        std::clog<<"\t [--refine iterations]: (Optional, default 0) After construction, run this many passes of Index::refine, which re-searches the neighbors of every node in the finished graph (on all cores)."<<std::endl;
+        std::clog<<"\t [--refine_ef ef_refine]: (Optional, default ef_construction) Search parameter used by --refine."<<std::endl;
         return -1;
     }
 
@@ -41,8 +49,52 @@ int main(int argc, char **argv){
     int M = 8;
     int ef_construction = 400;
     int num_verbose = 100000;
+    bool collect_perf = false;
+    int router_entries = 0;
+    bool build_hierarchy = false;
+    int bulk_threads = -1;
+    int refine_iterations = 0;
+    int ef_refine = 0;
 
     for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--perf",argv[i]) == 0){
+            collect_perf = true;
+        }
+        if (std::strcmp("--hierarchy",argv[i]) == 0){
+            build_hierarchy = true;
+        }
+        if (std::strcmp("--router",argv[i]) == 0){
+            if ((i+1) < argc){
+                router_entries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --router"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--bulk",argv[i]) == 0){
+            if ((i+1) < argc){
+                bulk_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --bulk"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--refine",argv[i]) == 0){
+            if ((i+1) < argc){
+                refine_iterations = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --refine"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--refine_ef",argv[i]) == 0){
+            if ((i+1) < argc){
+                ef_refine = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --refine_ef"<<std::endl; 
+                return -1;
+            }
+        }
         if (std::strcmp("--N",argv[i]) == 0){
             if ((i+1) < argc){
                 N = std::stoi(argv[i+1]);
@@ -86,6 +138,10 @@ int main(int argc, char **argv){
         return -1;
     }
 
+    if (ef_refine <= 0){
+        ef_refine = ef_construction;
+    }
+
     unsigned int dim_check;
     unsigned int num_check;
     input.read((char*)&num_check, 4);
@@ -106,24 +162,81 @@ int main(int argc, char **argv){
         space = new InnerProductSpace(dim_check);
     }
     Index<float, int> index(space, N, M);
+    if (build_hierarchy){
+        index.enable_hierarchy(ef_construction);
+    }
 
+    PerfCounters perf;
+    if (collect_perf){
+        if (!perf.available()){
+            std::clog<<"Warning: Hardware performance counters are unavailable (check kernel.perf_event_paranoid)."<<std::endl;
+        }
+        // the counters only run inside add / bulk_build, so reading the data file is not counted
+        perf.reset();
+    }
     auto start = std::chrono::high_resolution_clock::now();
-    float *element = new float[dim_check];
-    for (int label = 0; label < N; label++) {
-        input.read((char*) element, 4*dim_check);
-        index.add((void*) element, label, ef_construction, 1000);
-        if (num_verbose > 0){
-            if (label%num_verbose == 0){std::clog<<"+";}
+    if (bulk_threads >= 0){
+        float *data = new float[(size_t)(N) * dim_check];
+        std::vector<int> labels(N);
+        input.read((char*) data, (size_t)(N) * 4*dim_check);
+        for (int label = 0; label < N; label++) {
+            labels[label] = label;
         }
+        if (collect_perf){ perf.resume(); }
+        index.bulk_build((void*) data, labels.data(), N, ef_construction, bulk_threads);
+        if (collect_perf){ perf.pause(); }
+        delete[] data;
+    } else {
+        float *element = new float[dim_check];
+        for (int label = 0; label < N; label++) {
+            input.read((char*) element, 4*dim_check);
+            if (collect_perf){ perf.resume(); }
+            index.add((void*) element, label, ef_construction, 1000);
+            if (collect_perf){ perf.pause(); }
+            if (num_verbose > 0){
+                if (label%num_verbose == 0){std::clog<<"+";}
+            }
+        }
+        std::clog<<std::endl;
+        delete[] element;
     }
-    std::clog<<std::endl;
-    delete[] element;
     input.close();
 
     auto stop = std::chrono::high_resolution_clock::now();
+    if (collect_perf){ perf.stop(); }
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
     std::clog << "Build time: " << (float)(duration.count())/(1000.0) << " seconds" << std::endl; 
+    if (collect_perf){
+        std::clog << "Hardware counters per insert (-1 if unavailable): ";
+        PerfCounters::print_header(std::clog);
+        std::clog << std::endl << "    ";
+        perf.print_values(std::clog, N);
+        std::clog << std::endl;
+    }
 
+    if (refine_iterations > 0){
+        auto start_refine = std::chrono::high_resolution_clock::now();
+        index.refine(refine_iterations, ef_refine);
+        auto stop_refine = std::chrono::high_resolution_clock::now();
+        auto duration_refine = std::chrono::duration_cast<std::chrono::milliseconds>(stop_refine - start_refine);
+        std::clog << "Refined the graph "<< refine_iterations <<" times in " << (float)(duration_refine.count())/(1000.0) << " seconds" << std::endl; 
+    }
+
+    if (!index.connected()){
+        std::clog << "Warning: some nodes cannot be reached from node 0, so searches will not find them" << std::endl;
+    }
+
+    if (router_entries > 0){
+        auto start_router = std::chrono::high_resolution_clock::now();
+        index.build_router(router_entries);
+        auto stop_router = std::chrono::high_resolution_clock::now();
+        auto duration_router = std::chrono::duration_cast<std::chrono::milliseconds>(stop_router - start_router);
+        std::clog << "Built entry point router with "<< index.router_size() <<" entries in " << (float)(duration_router.count())/(1000.0) << " seconds" << std::endl; 
+    }
+
+    if (build_hierarchy){
+        std::clog << "Built "<< index.hierarchy_levels() <<" upper layers" << std::endl;
+    }
     std::clog << "Saving index to: " << outfilename << std::endl;
     index.save(outfilename);
 
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <utility>
+
+#include "../flatnav/Index.h"
+#include <algorithm>
+#include <string>
+#include <cstring>
+
+
+int main(int argc, char **argv){
+
+    if (argc < 6){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"merge_float32 <index> <other_index> <space> <dim> <outfile>";
+        std::clog<<" [--ef ef_construction] [--threads num_threads] [--router num_entries] [--offset_labels]"<<std::endl;
+        std::clog<<"Merges two float32 indexes built with the same space and M (see Index::merge)."<<std::endl;
+        std::clog<<"Positional arguments:"<<std::endl;
+        std::clog<<"\t index: Filename for the main index (float32 index)."<<std::endl;
+        std::clog<<"\t other_index: Filename for the index to merge into it, e.g. a delta index of new points (float32 index)."<<std::endl;
+        std::clog<<"\t space: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
+        std::clog<<"\t dim: Dimension of the vectors."<<std::endl;
+        std::clog<<"\t outfile: Filename for the merged index."<<std::endl;
+
+        std::clog<<"Optional arguments:"<<std::endl;
+        std::clog<<"\t [--ef ef_construction]: (Optional, default 100) Search parameter used to connect the two graphs."<<std::endl;
+        std::clog<<"\t [--threads num_threads]: (Optional, default 0) Number of threads. If 0, uses all cores."<<std::endl;
+        std::clog<<"\t [--router num_entries]: (Optional, default 0) Rebuild the entry point router over the merged index with this many entries."<<std::endl;
+        std::clog<<"\t [--offset_labels]: (Optional) Add the size of the main index to the labels of the other index. The construct tools label points by their position in the data file, so use this when other_index was built from the points that follow the main index's points."<<std::endl;
+        return -1;
+    }
+
+    // Optional arguments.
+    int ef_construction = 100;
+    int num_threads = 0;
+    int router_entries = 0;
+    bool offset_labels = false;
+
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--offset_labels",argv[i]) == 0){
+            offset_labels = true;
+        }
+        if (std::strcmp("--ef",argv[i]) == 0){
+            if ((i+1) < argc){
+                ef_construction = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --ef"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --threads"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--router",argv[i]) == 0){
+            if ((i+1) < argc){
+                router_entries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --router"<<std::endl;
+                return -1;
+            }
+        }
+    }
+    if (ef_construction <= 0){
+        std::cerr<<"Invalid argument for optional parameter --ef: Must be positive integer."<<std::endl;
+        return -1;
+    }
+
+    // Positional arguments.
+    std::string indexfilename(argv[1]);
+    std::string otherfilename(argv[2]);
+    int space_ID = std::stoi(argv[3]);
+    int dim = std::stoi(argv[4]);
+    std::string outfilename(argv[5]);
+
+    SpaceInterface<float>* space;
+    if (space_ID == 0){
+        space = new L2Space(dim);
+    } else {
+        space = new InnerProductSpace(dim);
+    }
+
+    Index<float, int> index(space, indexfilename);
+    Index<float, int> other(space, otherfilename);
+    std::clog<<"Merging "<<other.size()<<" nodes into an index of "<<index.size()<<" nodes."<<std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int label_offset = offset_labels ? index.size() : 0;
+    if (!index.merge(other, ef_construction, num_threads, label_offset)){
+        std::cerr<<"Error: The indexes have different M or dimension."<<std::endl;
+        return -1;
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+    std::clog << "Merge time: " << (float)(duration.count())/(1000.0) << " seconds" << std::endl;
+
+    if (router_entries > 0){
+        index.build_router(router_entries, 0, 5, num_threads);
+        std::clog << "Built entry point router with "<< index.router_size() <<" entries" << std::endl;
+    }
+
+    std::clog << "Saving index to: " << outfilename << std::endl;
+    index.save(outfilename);
+
+    return 0;
+}
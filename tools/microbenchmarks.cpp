@@ -0,0 +1,368 @@
+#include <vector>
+#include <random>
+#include <cstdlib>
+
+#include <benchmark/benchmark.h>
+
+#include "../flatnav/Index.h"
+#include "../flatnav/SpaceInterface.h"
+#include "../flatnav/ExplicitSet.h"
+#include "../flatnav/HashBasedBooleanSet.h"
+#include "../flatnav/GorderPriorityQueue.h"
+#include "../flatnav/WeightedPriorityQueue.h"
+
+// Microbenchmarks for the hot paths of graph search: distance kernels, visited sets,
+// the reordering priority queues and beamSearch itself. Run with --benchmark_filter=<regex>
+// to select a subset, and --benchmark_format=json (or csv) for machine-readable output.
+
+
+static std::vector<float> randomFloats(size_t n, int seed){
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist;
+    std::vector<float> out(n);
+    for (size_t i = 0; i < n; i++){ out[i] = dist(rng); }
+    return out;
+}
+
+static std::vector<unsigned char> randomBytes(size_t n, int seed){
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> dist(0, 255);
+    std::vector<unsigned char> out(n);
+    for (size_t i = 0; i < n; i++){ out[i] = (unsigned char)(dist(rng)); }
+    return out;
+}
+
+// Distance kernels. Each kernel is run against a small pool of vectors so that the
+// benchmark measures arithmetic rather than a single pair of cache-resident vectors.
+
+static const size_t NUM_VECTORS = 64;
+
+template <DistanceFunction<float> kernel>
+static void BM_FloatKernel(benchmark::State& state){
+    size_t dim = state.range(0);
+    std::vector<float> query = randomFloats(dim, 0);
+    std::vector<float> data = randomFloats(dim * NUM_VECTORS, 1);
+    size_t i = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(kernel(query.data(), data.data() + dim * i, &dim));
+        i = (i + 1) % NUM_VECTORS;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * dim * sizeof(float));
+}
+
+template <DistanceFunction<int> kernel>
+static void BM_IntKernel(benchmark::State& state){
+    size_t dim = state.range(0);
+    std::vector<unsigned char> query = randomBytes(dim, 0);
+    std::vector<unsigned char> data = randomBytes(dim * NUM_VECTORS, 1);
+    size_t i = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(kernel(query.data(), data.data() + dim * i, &dim));
+        i = (i + 1) % NUM_VECTORS;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * dim);
+}
+
+// Kernels that require dim to be a multiple of 4 or 16 get powers of two. Residual kernels
+// get dimensions that are one past a power of two, so that the scalar tail is always exercised.
+static void AlignedDims(benchmark::internal::Benchmark* b, int min_dim){
+    for (int dim = min_dim; dim <= 1024; dim *= 2){ b->Arg(dim); }
+}
+static void Multiple4Dims(benchmark::internal::Benchmark* b){ AlignedDims(b, 4); }
+static void Multiple16Dims(benchmark::internal::Benchmark* b){ AlignedDims(b, 16); }
+static void ResidualDims(benchmark::internal::Benchmark* b){
+    for (int dim = 4; dim <= 1024; dim *= 2){ b->Arg(dim + 1); }
+}
+static void Residual16Dims(benchmark::internal::Benchmark* b){
+    for (int dim = 16; dim <= 1024; dim *= 2){ b->Arg(dim + 1); }
+}
+
+BENCHMARK_TEMPLATE(BM_FloatKernel, L2Sqr)->Apply(Multiple4Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, InnerProduct)->Apply(Multiple4Dims);
+BENCHMARK_TEMPLATE(BM_IntKernel, L2SqrI)->Apply(Multiple4Dims);
+#if defined(USE_SSE) || defined(USE_AVX)
+BENCHMARK_TEMPLATE(BM_FloatKernel, L2SqrSIMD16Ext)->Apply(Multiple16Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, L2SqrSIMD16ExtResiduals)->Apply(Residual16Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, InnerProductSIMD16Ext)->Apply(Multiple16Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, InnerProductSIMD4Ext)->Apply(Multiple4Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, InnerProductSIMD16ExtResiduals)->Apply(Residual16Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, InnerProductSIMD4ExtResiduals)->Apply(ResidualDims);
+#endif
+#if defined(USE_SSE)
+BENCHMARK_TEMPLATE(BM_FloatKernel, L2SqrSIMD4Ext)->Apply(Multiple4Dims);
+BENCHMARK_TEMPLATE(BM_FloatKernel, L2SqrSIMD4ExtResiduals)->Apply(ResidualDims);
+#endif
+
+// Batched kernels, on batches of NUM_BATCH vectors (about the number of unvisited neighbors of an expanded node).
+// Items are distances, so items_per_second compares directly with the single-vector kernels above.
+
+static const size_t NUM_BATCH = 8;
+
+template <BatchDistanceFunction<float> kernel>
+static void BM_FloatBatchKernel(benchmark::State& state){
+    size_t dim = state.range(0);
+    std::vector<float> query = randomFloats(dim, 0);
+    std::vector<float> data = randomFloats(dim * NUM_VECTORS, 1);
+    std::vector<const void*> pointers(NUM_VECTORS);
+    for (size_t i = 0; i < NUM_VECTORS; i++){ pointers[i] = data.data() + dim * i; }
+    float out[NUM_BATCH];
+    size_t i = 0;
+    for (auto _ : state){
+        kernel(query.data(), pointers.data() + i, NUM_BATCH, out, &dim);
+        benchmark::DoNotOptimize(out);
+        i = (i + NUM_BATCH) % NUM_VECTORS;
+    }
+    state.SetItemsProcessed(state.iterations() * NUM_BATCH);
+    state.SetBytesProcessed(state.iterations() * NUM_BATCH * dim * sizeof(float));
+}
+
+#if defined(USE_SSE) || defined(USE_AVX)
+BENCHMARK_TEMPLATE(BM_FloatBatchKernel, L2SqrBatch)->Apply(Multiple4Dims)->Apply(ResidualDims);
+BENCHMARK_TEMPLATE(BM_FloatBatchKernel, InnerProductBatch)->Apply(Multiple4Dims)->Apply(ResidualDims);
+#endif
+
+// The same batches through the fixed-dimension kernels (see L2FixedSpace), which are unrolled and inlined. Compare
+// with the runtime batched kernels at the same dimension, e.g. --benchmark_filter='BatchKernel.*/(96|128|960)$'.
+
+template <typename fixed_space_t>
+static void BM_FixedBatchKernel(benchmark::State& state){
+    size_t dim = fixed_space_t::dim;
+    std::vector<float> query = randomFloats(dim, 0);
+    std::vector<float> data = randomFloats(dim * NUM_VECTORS, 1);
+    std::vector<const void*> pointers(NUM_VECTORS);
+    for (size_t i = 0; i < NUM_VECTORS; i++){ pointers[i] = data.data() + dim * i; }
+    float out[NUM_BATCH];
+    size_t i = 0;
+    for (auto _ : state){
+        fixed_space_t::batch(query.data(), pointers.data() + i, NUM_BATCH, out);
+        benchmark::DoNotOptimize(out);
+        i = (i + NUM_BATCH) % NUM_VECTORS;
+    }
+    state.SetItemsProcessed(state.iterations() * NUM_BATCH);
+    state.SetBytesProcessed(state.iterations() * NUM_BATCH * dim * sizeof(float));
+}
+
+#if defined(USE_SSE) || defined(USE_AVX)
+// the fixed dimensions that are not powers of two, which the runtime kernels above skip
+BENCHMARK_TEMPLATE(BM_FloatBatchKernel, L2SqrBatch)->Arg(96)->Arg(100)->Arg(384)->Arg(768)->Arg(960);
+#endif
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<96>)->Arg(96);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<100>)->Arg(100);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<128>)->Arg(128);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<256>)->Arg(256);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<384>)->Arg(384);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<768>)->Arg(768);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, L2FixedSpace<960>)->Arg(960);
+BENCHMARK_TEMPLATE(BM_FixedBatchKernel, InnerProductFixedSpace<128>)->Arg(128);
+
+
+// Visited sets. A search touches a few hundred random nodes and then clears the set,
+// so we time that pattern: clear, then insert/lookup a batch of random node IDs.
+
+static const int NUM_TOUCHED = 512;
+
+static std::vector<unsigned int> randomNodes(size_t table_size, int seed){
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<unsigned int> dist(1, table_size - 1);
+    std::vector<unsigned int> nodes(NUM_TOUCHED);
+    for (int i = 0; i < NUM_TOUCHED; i++){ nodes[i] = dist(rng); }
+    return nodes;
+}
+
+template <typename SetType>
+static void BM_VisitedSetInsert(benchmark::State& state){
+    size_t table_size = state.range(0);
+    SetType set(table_size);
+    std::vector<unsigned int> nodes = randomNodes(table_size, 0);
+    for (auto _ : state){
+        set.clear();
+        for (unsigned int node : nodes){ set.insert(node); }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * NUM_TOUCHED);
+}
+
+template <typename SetType>
+static void BM_VisitedSetLookup(benchmark::State& state){
+    size_t table_size = state.range(0);
+    SetType set(table_size);
+    std::vector<unsigned int> inserted = randomNodes(table_size, 0);
+    std::vector<unsigned int> queried = randomNodes(table_size, 1);
+    set.clear();
+    for (unsigned int node : inserted){ set.insert(node); }
+    for (auto _ : state){
+        int hits = 0;
+        for (unsigned int node : queried){ hits += set[node]; }
+        benchmark::DoNotOptimize(hits);
+    }
+    state.SetItemsProcessed(state.iterations() * NUM_TOUCHED);
+}
+
+BENCHMARK_TEMPLATE(BM_VisitedSetInsert, ExplicitSet)->RangeMultiplier(100)->Range(10000, 10000000);
+BENCHMARK_TEMPLATE(BM_VisitedSetInsert, HashBasedBooleanSet)->RangeMultiplier(100)->Range(10000, 10000000);
+BENCHMARK_TEMPLATE(BM_VisitedSetLookup, ExplicitSet)->RangeMultiplier(100)->Range(10000, 10000000);
+BENCHMARK_TEMPLATE(BM_VisitedSetLookup, HashBasedBooleanSet)->RangeMultiplier(100)->Range(10000, 10000000);
+
+
+// Reordering priority queues. Gorder-style orderings spend nearly all of their time in
+// increment/decrement, so we time a batch of those followed by a pop.
+
+static const int NUM_UPDATES = 1000;
+
+static void BM_GorderPriorityQueue(benchmark::State& state){
+    size_t N = state.range(0);
+    GorderPriorityQueue<unsigned int> Q(N);
+    std::vector<unsigned int> keys = randomNodes(N, 0);
+    for (auto _ : state){
+        for (int i = 0; i < NUM_UPDATES; i++){ Q.increment(keys[i % NUM_TOUCHED]); }
+        for (int i = 0; i < NUM_UPDATES; i++){ Q.decrement(keys[i % NUM_TOUCHED]); }
+        state.PauseTiming();
+        if (Q.size() < 2){ Q = GorderPriorityQueue<unsigned int>(N); }
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(Q.pop());
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * NUM_UPDATES);
+}
+
+static void BM_WeightedPriorityQueue(benchmark::State& state){
+    size_t N = state.range(0);
+    WeightedPriorityQueue<unsigned int> Q(N);
+    std::vector<unsigned int> keys = randomNodes(N, 0);
+    for (auto _ : state){
+        for (int i = 0; i < NUM_UPDATES; i++){ Q.increment(keys[i % NUM_TOUCHED], 1.0); }
+        for (int i = 0; i < NUM_UPDATES; i++){ Q.decrement(keys[i % NUM_TOUCHED], 1.0); }
+        state.PauseTiming();
+        if (Q.size() < 2){ Q = WeightedPriorityQueue<unsigned int>(N); }
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(Q.pop());
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * NUM_UPDATES);
+}
+
+BENCHMARK(BM_GorderPriorityQueue)->Arg(10000)->Arg(100000);
+BENCHMARK(BM_WeightedPriorityQueue)->Arg(10000)->Arg(100000);
+
+
+// beamSearch on a synthetic graph. The index is built once (on first use) from clustered
+// Gaussian data, and each benchmark iteration runs one query through Index::search.
+
+static const int GRAPH_N = 20000;
+static const int GRAPH_DIM = 64;
+static const int GRAPH_M = 16;
+static const int NUM_QUERIES = 256;
+
+static std::vector<float> clusteredFloats(size_t n, size_t dim, int seed){
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist;
+    std::vector<float> centers = randomFloats(100 * dim, 12345);
+    std::uniform_int_distribution<int> cluster(0, 99);
+    std::vector<float> out(n * dim);
+    for (size_t i = 0; i < n; i++){
+        int c = cluster(rng);
+        for (size_t j = 0; j < dim; j++){ out[i * dim + j] = 3 * centers[c * dim + j] + dist(rng); }
+    }
+    return out;
+}
+
+template <typename IndexType = Index<float, int>, size_t dim = GRAPH_DIM>
+static IndexType& syntheticIndex(){
+    static L2Space space(dim);
+    static IndexType* index = NULL;
+    if (index == NULL){
+        index = new IndexType(&space, GRAPH_N, GRAPH_M);
+        std::vector<float> data = clusteredFloats(GRAPH_N, dim, 0);
+        for (int label = 0; label < GRAPH_N; label++){
+            index->add(data.data() + label * dim, label, 100);
+        }
+    }
+    return *index;
+}
+
+// Templated on the node ID width, since 16-bit IDs halve the link blocks (GRAPH_N fits in 16 bits).
+template <typename node_id_t>
+static void BM_BeamSearch(benchmark::State& state){
+    Index<float, int, node_id_t>& index = syntheticIndex< Index<float, int, node_id_t> >();
+    std::vector<float> queries = clusteredFloats(NUM_QUERIES, GRAPH_DIM, 1);
+    int ef_search = state.range(0);
+    int q = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(index.search(queries.data() + q * GRAPH_DIM, 10, ef_search, 10));
+        q = (q + 1) % NUM_QUERIES;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_BeamSearch, unsigned int)->Arg(16)->Arg(64)->Arg(256);
+BENCHMARK_TEMPLATE(BM_BeamSearch, uint16_t)->Arg(16)->Arg(64)->Arg(256);
+
+// Search on a 128-dimensional graph, with the distances through function pointers (RuntimeSpace) or inlined
+// (L2FixedSpace<128>). The two graphs are built the same way, so they only differ by float rounding.
+static const size_t FIXED_GRAPH_DIM = 128;
+
+template <typename fixed_space_t>
+static void BM_FixedDimSearch(benchmark::State& state){
+    typedef Index<float, int, unsigned int, fixed_space_t> IndexType;
+    IndexType& index = syntheticIndex<IndexType, FIXED_GRAPH_DIM>();
+    std::vector<float> queries = clusteredFloats(NUM_QUERIES, FIXED_GRAPH_DIM, 1);
+    int ef_search = state.range(0);
+    int q = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(index.search(queries.data() + q * FIXED_GRAPH_DIM, 10, ef_search, 10));
+        q = (q + 1) % NUM_QUERIES;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_FixedDimSearch, RuntimeSpace)->Arg(16)->Arg(64)->Arg(256);
+BENCHMARK_TEMPLATE(BM_FixedDimSearch, L2FixedSpace<FIXED_GRAPH_DIM>)->Arg(16)->Arg(64)->Arg(256);
+
+// Search with a warm query cache, i.e. the cost of a repeated query.
+static void BM_CachedSearch(benchmark::State& state){
+    Index<float, int>& index = syntheticIndex();
+    std::vector<float> queries = clusteredFloats(NUM_QUERIES, GRAPH_DIM, 1);
+    int ef_search = state.range(0);
+    // leave headroom, since the cache shards do not fill evenly
+    index.enable_query_cache(2 * NUM_QUERIES);
+    for (int q = 0; q < NUM_QUERIES; q++){
+        index.search(queries.data() + q * GRAPH_DIM, 10, ef_search, 10);
+    }
+    int q = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(index.search(queries.data() + q * GRAPH_DIM, 10, ef_search, 10));
+        q = (q + 1) % NUM_QUERIES;
+    }
+    index.disable_query_cache();
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_CachedSearch)->Arg(64);
+
+// Search with delta-compressed links (Index::compress_links), after GORDER. Reports the link memory as a counter.
+static void BM_CompressedSearch(benchmark::State& state){
+    static L2Space space(GRAPH_DIM);
+    static Index<float, int>* index = NULL;
+    if (index == NULL){
+        index = new Index<float, int>(&space, GRAPH_N, GRAPH_M);
+        std::vector<float> data = clusteredFloats(GRAPH_N, GRAPH_DIM, 0);
+        for (int label = 0; label < GRAPH_N; label++){
+            index->add(data.data() + label * GRAPH_DIM, label, 100);
+        }
+        index->reorder(Index<float, int>::GraphOrder::GORDER);
+    }
+    if (state.range(1)){ index->compress_links(); } else { index->decompress_links(); }
+    std::vector<float> queries = clusteredFloats(NUM_QUERIES, GRAPH_DIM, 1);
+    int ef_search = state.range(0);
+    int q = 0;
+    for (auto _ : state){
+        benchmark::DoNotOptimize(index->search(queries.data() + q * GRAPH_DIM, 10, ef_search, 10));
+        q = (q + 1) % NUM_QUERIES;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["link_bytes"] = index->link_memory_bytes();
+}
+
+BENCHMARK(BM_CompressedSearch)->ArgNames({"ef", "compressed"})->ArgsProduct({{16, 64, 256}, {0, 1}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,177 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <utility>
+#include <sstream>
+
+#include "../flatnav/DiskIndex.h"
+#include <algorithm>
+#include <string>
+#include <cstring>
+
+
+int main(int argc, char **argv){
+
+    if (argc < 7){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"query_disk <index> <space> <queries> <gtruth> <ef_search> <k>";
+        std::clog<<" [--nq num_queries] [--beam_width beam_width] [--cache_nodes cache_nodes] [--io_threads num_threads]"<<std::endl;
+        std::clog<<"Queries a float32 index without loading it into memory (see DiskIndex.h)."<<std::endl;
+        std::clog<<"Positional arguments:"<<std::endl;
+        std::clog<<"\t index: Filename for input index (float32 index)."<<std::endl;
+        std::clog<<"\t space: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
+        std::clog<<"\t queries: Filename for queries (float32 file)."<<std::endl;
+        std::clog<<"\t gtruth: Filename for ground truth (int32 file)."<<std::endl;
+        std::clog<<"\t ef_search: CSV list of int,int,int...,int ef_search parameters."<<std::endl;
+        std::clog<<"\t k: Number of neighbors to return."<<std::endl;
+
+        std::clog<<"Optional arguments:"<<std::endl;
+        std::clog<<"\t [--nq num_queries]: (Optional, default 0) Number of queries to use. If 0, uses all queries."<<std::endl;
+        std::clog<<"\t [--beam_width beam_width]: (Optional, default 4) Number of node records to read from disk at each search step."<<std::endl;
+        std::clog<<"\t [--cache_nodes cache_nodes]: (Optional, default 0) Number of node records near the entry points to keep in memory."<<std::endl;
+        std::clog<<"\t [--io_threads num_threads]: (Optional, default 0) Number of threads that issue reads. If 0, reads are issued one at a time by the search thread."<<std::endl;
+        return -1;
+    }
+
+    // Optional arguments.
+    int num_queries = 0;
+    int beam_width = 4;
+    int cache_nodes = 0;
+    int io_threads = 0;
+
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--nq",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_queries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --nq"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--beam_width",argv[i]) == 0){
+            if ((i+1) < argc){
+                beam_width = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --beam_width"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--cache_nodes",argv[i]) == 0){
+            if ((i+1) < argc){
+                cache_nodes = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --cache_nodes"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--io_threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                io_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --io_threads"<<std::endl;
+                return -1;
+            }
+        }
+    }
+    if (beam_width <= 0){
+        std::cerr<<"Invalid argument for optional parameter --beam_width: Must be positive integer."<<std::endl;
+        return -1;
+    }
+
+    // Positional arguments.
+    std::string indexfilename(argv[1]);
+    int space_ID = std::stoi(argv[2]);
+
+    // Load queries.
+    std::ifstream querystream(argv[3], std::ios::binary);
+    unsigned int dim;
+    unsigned int num_queries_check;
+    querystream.read((char*)&num_queries_check, 4);
+    querystream.read((char*)&dim, 4);
+    if (num_queries == 0){
+        num_queries = num_queries_check;
+    }
+    std::clog<<"Reading "<<num_queries<<" queries of "<<num_queries_check<<" total queries of dimension "<<dim<<"."<<std::endl;
+    float* queries = new float[num_queries * dim];
+    for (size_t i = 0; i < num_queries; i++){
+        querystream.read((char*)(queries + dim*i), 4*dim);
+    }
+    querystream.close();
+
+    // Load ground truth.
+    std::ifstream truthstream(argv[4], std::ios::binary);
+    int num_gtruth_lists;
+    int num_gtruth_entries;
+    truthstream.read((char*)&num_gtruth_lists, 4);
+    truthstream.read((char*)&num_gtruth_entries, 4);
+    if (num_gtruth_lists < num_queries){
+        std::cerr<<"Error: Need at least "<<num_queries<<" gtruth lists."<<std::endl;
+        return -1;
+    }
+    unsigned int* gtruth = new unsigned int[num_gtruth_lists * num_gtruth_entries];
+    for (size_t i = 0; i < num_gtruth_lists; i++){
+        truthstream.read((char*)(gtruth + num_gtruth_entries*i), num_gtruth_entries * 4);
+    }
+    truthstream.close();
+
+    // EF search vector.
+    std::vector<int> ef_searches;
+    std::stringstream ss(argv[5]);
+    int element = 0;
+    while(ss >> element){
+        ef_searches.push_back(element);
+        if (ss.peek() == ',') ss.ignore();
+    }
+    int k = std::stoi(argv[6]);
+    if (k > num_gtruth_entries){
+        std::cerr<<"K is larger than the number of precomputed ground truth neighbors."<<std::endl;
+        return -1;
+    }
+
+    SpaceInterface<float>* space;
+    if (space_ID == 0){
+        space = new L2Space(dim);
+    } else {
+        space = new InnerProductSpace(dim);
+    }
+    std::clog<<"Opening index "<<indexfilename<<std::endl;
+    auto start_open = std::chrono::high_resolution_clock::now();
+    DiskIndex<int> index(space, indexfilename, cache_nodes, io_threads);
+    auto stop_open = std::chrono::high_resolution_clock::now();
+    std::clog<<"Opened "<<index.size()<<" nodes in "<<std::chrono::duration<double>(stop_open - start_open).count();
+    std::clog<<" seconds, using "<<index.memory_bytes() / (1024.0 * 1024.0)<<" MB of memory."<<std::endl;
+
+    std::cout<<"ef_search,recall,mean_latency_ms,reads_per_query"<<std::endl;
+    for (int ef_search : ef_searches){
+        double mean_recall = 0;
+        double total_reads = 0;
+        auto start_q = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_queries; i++){
+            float* q = queries + dim*i;
+            unsigned int* g = gtruth + num_gtruth_entries*i;
+            size_t num_reads = 0;
+            std::vector<std::pair<float, int> > result = index.search(q, k, ef_search, beam_width, 100, &num_reads);
+            total_reads += num_reads;
+
+            double recall = 0;
+            for (int j = 0; j < k && j < result.size(); j++){
+                for (int l = 0; l < k; l++){
+                    if (result[j].second == g[l]){
+                        recall = recall + 1;
+                    }
+                }
+            }
+            mean_recall = mean_recall + recall / k;
+        }
+        auto stop_q = std::chrono::high_resolution_clock::now();
+        auto duration_q = std::chrono::duration_cast<std::chrono::microseconds>(stop_q - start_q);
+        std::cout<<ef_search<<","<<mean_recall / num_queries<<","<<(float)(duration_q.count()) / (1000.0 * num_queries);
+        std::cout<<","<<total_reads / num_queries<<std::endl;
+    }
+
+    delete[] queries;
+    delete[] gtruth;
+    return 0;
+}
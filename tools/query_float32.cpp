@@ -8,8 +8,10 @@
 #include <sstream>
 
 #include "../flatnav/Index.h"
+#include "../flatnav/PerfCounters.h"
 #include <algorithm>
 #include <string>
+#include <cstring>
 
 
 int main(int argc, char **argv){
@@ -17,7 +19,8 @@ int main(int argc, char **argv){
     if (argc < 7){
         std::clog<<"Usage: "<<std::endl; 
         std::clog<<"query <index> <space> <queries> <gtruth> <ef_search> <k>";
-        std::clog<<" [--nq num_queries] [--reorder_id reorder_id] [--ef_profile ef_profile] [--num_profile num_profile]"<<std::endl;
+        std::clog<<" [--nq num_queries] [--reorder_id reorder_id] [--ef_profile ef_profile] [--num_profile num_profile] [--profile_threads num_threads]";
+        std::clog<<" [--patience patience] [--min_improvement min_improvement] [--stats] [--perf] [--router num_entries] [--hierarchy] [--compress]"<<std::endl;
         std::clog<<"Positional arguments:"<<std::endl;
         std::clog<<"\t index: Filename for input index (float32 index)."<<std::endl;
         std::clog<<"\t space: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
@@ -31,6 +34,14 @@ int main(int argc, char **argv){
         std::clog<<"\t [--reorder_id reorder_id]: (Optional, default 0) Which reordering algorithm to use? 0:none 1:gorder 2:indegsort 3:outdegsort 4:RCM 5:hubsort 6:hubcluster 7:DBG 8:corder 91:profiled_gorder 94:profiled_rcm 41:RCM+gorder"<<std::endl;
         std::clog<<"\t [--ef_profile ef_profile]: (Optional, default 100) ef_search parameter to use for profiling."<<std::endl;
         std::clog<<"\t [--num_profile num_profile]: (Optional, default 1000) Number of queries to use for profiling."<<std::endl;
+        std::clog<<"\t [--profile_threads num_threads]: (Optional, default 0) Number of threads to use for profiling. If 0, uses all cores."<<std::endl;
+        std::clog<<"\t [--patience patience]: (Optional, default 0) Stop a query after this many expansions that do not improve the top-k. If 0, no early termination."<<std::endl;
+        std::clog<<"\t [--min_improvement min_improvement]: (Optional, default 0) Expansions that improve the k-th distance by less than this fraction also count against patience."<<std::endl;
+        std::clog<<"\t [--stats]: (Optional) Collect per-query search statistics and report their mean as extra CSV columns."<<std::endl;
+        std::clog<<"\t [--perf]: (Optional) Measure hardware performance counters (cycles, instructions, L1D/LLC/dTLB misses) and report them per query as extra CSV columns. Linux only."<<std::endl;
+        std::clog<<"\t [--router num_entries]: (Optional, default 0) Build an entry point router with this many entries after reordering, replacing the strided entry point search. An index saved with a router uses it automatically."<<std::endl;
+        std::clog<<"\t [--hierarchy]: (Optional) Build HNSW-style upper layers over the index after reordering and use them to pick entry nodes. An index saved with upper layers uses them automatically."<<std::endl;
+        std::clog<<"\t [--compress]: (Optional) Delta-compress the links after reordering (see Index::compress_links) and report the memory they use."<<std::endl;
         return -1;
     }
 
@@ -39,8 +50,36 @@ int main(int argc, char **argv){
     int reorder_ID = 0;
     int ef_profile = 100;
     int num_profile = 1000;
+    int profile_threads = 0;
+    int patience = 0;
+    float min_improvement = 0;
+    bool collect_stats = false;
+    bool collect_perf = false;
+    int router_entries = 0;
+    bool build_hierarchy = false;
+    bool compress_links = false;
 
     for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--stats",argv[i]) == 0){
+            collect_stats = true;
+        }
+        if (std::strcmp("--perf",argv[i]) == 0){
+            collect_perf = true;
+        }
+        if (std::strcmp("--hierarchy",argv[i]) == 0){
+            build_hierarchy = true;
+        }
+        if (std::strcmp("--compress",argv[i]) == 0){
+            compress_links = true;
+        }
+        if (std::strcmp("--router",argv[i]) == 0){
+            if ((i+1) < argc){
+                router_entries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --router"<<std::endl; 
+                return -1;
+            }
+        }
         if (std::strcmp("--nq",argv[i]) == 0){
             if ((i+1) < argc){
                 num_queries = std::stoi(argv[i+1]);
@@ -65,6 +104,14 @@ int main(int argc, char **argv){
                 return -1;
             }
         }
+        if (std::strcmp("--profile_threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                profile_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --profile_threads"<<std::endl; 
+                return -1;
+            }
+        }
         if (std::strcmp("--num_profile",argv[i]) == 0){
             if ((i+1) < argc){
                 num_profile = std::stoi(argv[i+1]);
@@ -73,6 +120,22 @@ int main(int argc, char **argv){
                 return -1;
             }
         }
+        if (std::strcmp("--patience",argv[i]) == 0){
+            if ((i+1) < argc){
+                patience = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --patience"<<std::endl; 
+                return -1;
+            }
+        }
+        if (std::strcmp("--min_improvement",argv[i]) == 0){
+            if ((i+1) < argc){
+                min_improvement = std::stof(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --min_improvement"<<std::endl; 
+                return -1;
+            }
+        }
     }
     // Positional arguments.
     std::string indexfilename(argv[1]);  // Index filename.
@@ -235,7 +298,7 @@ int main(int argc, char **argv){
         std::clog<<"Using profile-based GORDER"<<std::endl;
         std::clog<<"Reordering"<<std::endl;
         auto start_r = std::chrono::high_resolution_clock::now();
-        index.profile_reorder(queries, num_profile, ef_profile, Index<float, int>::ProfileOrder::GORDER);
+        index.profile_reorder(queries, num_profile, ef_profile, Index<float, int>::ProfileOrder::GORDER, profile_threads);
         auto stop_r = std::chrono::high_resolution_clock::now();
         auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
         std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
@@ -244,7 +307,7 @@ int main(int argc, char **argv){
         std::clog<<"Using profile-based RCM"<<std::endl;
         std::clog<<"Reordering"<<std::endl;
         auto start_r = std::chrono::high_resolution_clock::now();
-        index.profile_reorder(queries, num_profile, ef_profile, Index<float, int>::ProfileOrder::RCM);
+        index.profile_reorder(queries, num_profile, ef_profile, Index<float, int>::ProfileOrder::RCM, profile_threads);
         auto stop_r = std::chrono::high_resolution_clock::now();
         auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
         std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
@@ -253,17 +316,77 @@ int main(int argc, char **argv){
         std::clog<<"No reordering"<<std::endl;
     }
 
+    if (router_entries > 0){
+        auto start_router = std::chrono::high_resolution_clock::now();
+        index.build_router(router_entries);
+        auto stop_router = std::chrono::high_resolution_clock::now();
+        auto duration_router = std::chrono::duration_cast<std::chrono::milliseconds>(stop_router - start_router);
+        std::clog << "Built entry point router with "<< index.router_size() <<" entries in " << (float)(duration_router.count())/(1000.0) << " seconds" << std::endl; 
+    }
+    else if (index.router_size() > 0){
+        std::clog << "Using the index's entry point router with "<< index.router_size() <<" entries" << std::endl;
+    }
+    if (build_hierarchy){
+        auto start_hierarchy = std::chrono::high_resolution_clock::now();
+        index.enable_hierarchy();
+        auto stop_hierarchy = std::chrono::high_resolution_clock::now();
+        auto duration_hierarchy = std::chrono::duration_cast<std::chrono::milliseconds>(stop_hierarchy - start_hierarchy);
+        std::clog << "Built "<< index.hierarchy_levels() <<" upper layers in " << (float)(duration_hierarchy.count())/(1000.0) << " seconds" << std::endl; 
+    }
+    else if (index.hierarchy_levels() > 0){
+        std::clog << "Using the index's "<< index.hierarchy_levels() <<" upper layers to pick entry nodes" << std::endl;
+    }
+
+    if (compress_links){
+        size_t uncompressed_bytes = index.link_memory_bytes();
+        index.compress_links();
+        std::clog << "Compressed links from "<< uncompressed_bytes / (1024.0 * 1024.0) <<" MB to "<< index.link_memory_bytes() / (1024.0 * 1024.0) <<" MB" << std::endl;
+    }
+
+    Index<float, int>::EarlyTermination termination(patience, min_improvement);
+    if (patience > 0){
+        std::clog<<"Using early termination with patience "<<patience<<" and min_improvement "<<min_improvement<<std::endl;
+    }
+
     // Now, finally, do the actual search.
-    std::cout<<"recall, mean_latency_ms"<<std::endl;
+    PerfCounters perf;
+    if (collect_perf && !perf.available()){
+        std::clog<<"Warning: Hardware performance counters are unavailable (check kernel.perf_event_paranoid). Reporting -1."<<std::endl;
+    }
+    std::cout<<"recall, mean_latency_ms";
+    if (collect_stats){
+        std::cout<<", mean_distance_computations, mean_hops, mean_visited_inserts, mean_entry_distance, mean_final_distance, mean_initialization_us";
+    }
+    if (collect_perf){
+        std::cout<<",";
+        PerfCounters::print_header(std::cout, "_per_query");
+    }
+    std::cout<<std::endl;
     for (int& ef_search: ef_searches){
         double mean_recall = 0;
+        Index<float, int>::SearchStats stats;
+        double total_distance_computations = 0;
+        double total_hops = 0;
+        double total_visited_inserts = 0;
+        double total_entry_distance = 0;
+        double total_final_distance = 0;
+        double total_initialization_ns = 0;
 
+        if (collect_perf){ perf.start(); }
         auto start_q = std::chrono::high_resolution_clock::now();
         for (int i = 0; i < num_queries; i++){
             float* q = queries + dim*i;
             unsigned int* g = gtruth + num_gtruth_entries*i;
 
-            std::vector<std::pair<float, int> > result = index.search(q, k, ef_search);
+            std::vector<std::pair<float, int> > result = index.search(q, k, ef_search, 100, termination, collect_stats ? &stats : NULL);
+            if (collect_stats){
+                total_distance_computations += stats.distance_computations;
+                total_hops += stats.hops;
+                total_visited_inserts += stats.visited_inserts;
+                total_entry_distance += stats.entry_distance;
+                total_final_distance += stats.final_distance;
+                total_initialization_ns += stats.initialization_ns;
+            }
 
             double recall = 0;
             for (int j = 0; j <  k; j++){
@@ -277,8 +400,19 @@ int main(int argc, char **argv){
             mean_recall = mean_recall + recall;
         }
         auto stop_q = std::chrono::high_resolution_clock::now();
+        if (collect_perf){ perf.stop(); }
         auto duration_q = std::chrono::duration_cast<std::chrono::milliseconds>(stop_q - start_q);
-        std::cout<<mean_recall/num_queries<<","<<(float)(duration_q.count())/num_queries<<std::endl;
+        std::cout<<mean_recall/num_queries<<","<<(float)(duration_q.count())/num_queries;
+        if (collect_stats){
+            std::cout<<","<<total_distance_computations/num_queries<<","<<total_hops/num_queries;
+            std::cout<<","<<total_visited_inserts/num_queries<<","<<total_entry_distance/num_queries;
+            std::cout<<","<<total_final_distance/num_queries<<","<<total_initialization_ns/num_queries/1000.0;
+        }
+        if (collect_perf){
+            std::cout<<",";
+            perf.print_values(std::cout, num_queries);
+        }
+        std::cout<<std::endl;
     }
 
     delete[] queries; 
@@ -162,7 +162,7 @@ int main(int argc, char **argv){
         std::clog<<"Using profile-based GORDER"<<std::endl;
         std::clog<<"Reordering"<<std::endl;
         auto start_r = std::chrono::high_resolution_clock::now();
-        index.profile_reorder(queries, Nq, 1000, Index<float, int>::ProfileOrder::GORDER);
+        index.profile_reorder(queries, Nq, 1000, Index<float, int>::ProfileOrder::GORDER, 0);
         auto stop_r = std::chrono::high_resolution_clock::now();
         auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
         std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
@@ -171,7 +171,7 @@ int main(int argc, char **argv){
         std::clog<<"Using profile-based RCM"<<std::endl;
         std::clog<<"Reordering"<<std::endl;
         auto start_r = std::chrono::high_resolution_clock::now();
-        index.profile_reorder(queries, Nq, 1000, Index<float, int>::ProfileOrder::RCM);
+        index.profile_reorder(queries, Nq, 1000, Index<float, int>::ProfileOrder::RCM, 0);
         auto stop_r = std::chrono::high_resolution_clock::now();
         auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
         std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
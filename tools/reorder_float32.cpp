@@ -9,6 +9,7 @@
 #include "../flatnav/Index.h"
 #include <algorithm>
 #include <string>
+#include <cstring>
 
 
 int main(int argc, char **argv){
@@ -16,7 +17,7 @@ int main(int argc, char **argv){
     if (argc < 4){
         std::clog<<"Usage: "<<std::endl; 
         std::clog<<"query <index_in> <reorder_id> <index_out> ";
-        std::clog<<"[ <queries> <space> <num_queries> <ef_search> ]";
+        std::clog<<"[ <queries> <space> <num_queries> <ef_search> [--threads num_threads] ]";
         std::clog<<"Positional arguments:"<<std::endl;
         std::clog<<"\t <index_in>: Filename for input index (float32 index)."<<std::endl;
         std::clog<<"\t <reorder_id>: Which reordering algorithm to use? 0:none 1:gorder 2:indegsort 3:outdegsort 4:RCM 5:hubsort 6:hubcluster 7:DBG 8:corder 91:profiled_gorder 94:profiled_rcm 41:RCM+gorder"<<std::endl;
@@ -26,6 +27,7 @@ int main(int argc, char **argv){
         std::clog<<"\t <space>: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
         std::clog<<"\t <n_queries>: Number of queries to use for profiling."<<std::endl;
         std::clog<<"\t <ef_search>: Candidate list size for search with profiling."<<std::endl;
+        std::clog<<"\t [--threads num_threads]: (Optional, default 0) Number of threads for profiling. If 0, uses all cores."<<std::endl;
         return -1;
     }
 
@@ -33,6 +35,17 @@ int main(int argc, char **argv){
 	std::string outfile(argv[3]);
 
     int reorder_ID = std::stoi(argv[2]);
+    int num_threads = 0;
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --threads"<<std::endl; 
+                return -1;
+            }
+        }
+    }
     bool is_profiling = ((reorder_ID >= 90) && (reorder_ID < 100));
     if (is_profiling){
         // We are doing profiling, so we need the extra arguments.
@@ -72,7 +85,7 @@ int main(int argc, char **argv){
             std::clog<<"Using profile-based GORDER"<<std::endl;
             std::clog<<"Reordering"<<std::endl;
             auto start_r = std::chrono::high_resolution_clock::now();
-            index.profile_reorder(queries, num_queries, ef_search, Index<float, int>::ProfileOrder::GORDER);
+            index.profile_reorder(queries, num_queries, ef_search, Index<float, int>::ProfileOrder::GORDER, num_threads);
             auto stop_r = std::chrono::high_resolution_clock::now();
             auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
             std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
@@ -81,7 +94,7 @@ int main(int argc, char **argv){
             std::clog<<"Using profile-based RCM"<<std::endl;
             std::clog<<"Reordering"<<std::endl;
             auto start_r = std::chrono::high_resolution_clock::now();
-            index.profile_reorder(queries, num_queries, ef_search, Index<float, int>::ProfileOrder::RCM);
+            index.profile_reorder(queries, num_queries, ef_search, Index<float, int>::ProfileOrder::RCM, num_threads);
             auto stop_r = std::chrono::high_resolution_clock::now();
             auto duration_r = std::chrono::duration_cast<std::chrono::milliseconds>(stop_r - start_r);
             std::clog << "Reorder time: " << (float)(duration_r.count())/(1000.0) << " seconds" << std::endl; 
@@ -0,0 +1,280 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <utility>
+#include <sstream>
+
+#include "../flatnav/Index.h"
+#include "../flatnav/ShardedIndex.h"
+#include "../flatnav/ParallelFor.h"
+#include <algorithm>
+#include <string>
+#include <cstring>
+
+
+// Fraction of the true top-k neighbors that appear in the returned top-k.
+double recall_at_k(const std::vector<std::pair<float, int> >& result, const unsigned int* gtruth, int k){
+    double recall = 0;
+    for (int j = 0; j < k && j < result.size(); j++){
+        for (int l = 0; l < k; l++){
+            if (result[j].second == gtruth[l]){
+                recall = recall + 1;
+            }
+        }
+    }
+    return recall / k;
+}
+
+
+int main(int argc, char **argv){
+
+    if (argc < 7){
+        std::clog<<"Usage: "<<std::endl;
+        std::clog<<"sharded <data> <space> <queries> <gtruth> <ef_search> <k>";
+        std::clog<<" [--N num_vectors] [--M num_links] [--ef ef_construction] [--shards num_shards] [--threads num_threads]";
+        std::clog<<" [--reorder_id reorder_id] [--nq num_queries] [--no_monolithic]"<<std::endl;
+        std::clog<<"Builds a sharded index and a single (monolithic) index over the same data and reports build time,"<<std::endl;
+        std::clog<<"recall and QPS for both. The sharded index splits the (query, shard) pairs across threads (see search_batch),"<<std::endl;
+        std::clog<<"the monolithic index splits the queries across threads."<<std::endl;
+        std::clog<<"Positional arguments:"<<std::endl;
+        std::clog<<"\t data: Filename pointing to a float32 file (4 byte uint N, 4 byte uint dim, then list of 32-bit floats)."<<std::endl;
+        std::clog<<"\t space: Integer distance ID: 0 for L2 distance, 1 for inner product (angular distance)."<<std::endl;
+        std::clog<<"\t queries: Filename for queries (float32 file)."<<std::endl;
+        std::clog<<"\t gtruth: Filename for ground truth (int32 file)."<<std::endl;
+        std::clog<<"\t ef_search: CSV list of int,int,int...,int ef_search parameters."<<std::endl;
+        std::clog<<"\t k: Number of neighbors to return."<<std::endl;
+
+        std::clog<<"Optional arguments:"<<std::endl;
+        std::clog<<"\t [--N num_vectors]: (Optional, default 0) Number of vectors to include. If 0, uses full dataset."<<std::endl;
+        std::clog<<"\t [--M num_links]: (Optional, default 16) Max number of links per node."<<std::endl;
+        std::clog<<"\t [--ef ef_construction]: (Optional, default 100) Search parameter used for construction."<<std::endl;
+        std::clog<<"\t [--shards num_shards]: (Optional, default 4) Number of shards."<<std::endl;
+        std::clog<<"\t [--threads num_threads]: (Optional, default 0) Number of threads for building, reordering and querying. If 0, uses all cores."<<std::endl;
+        std::clog<<"\t [--reorder_id reorder_id]: (Optional, default 0) Which reordering algorithm to use? 0:none 1:gorder 2:indegsort 3:outdegsort 4:RCM 5:hubsort 6:hubcluster 7:DBG 8:corder"<<std::endl;
+        std::clog<<"\t [--nq num_queries]: (Optional, default 0) Number of queries to use. If 0, uses all queries."<<std::endl;
+        std::clog<<"\t [--no_monolithic]: (Optional) Only build and query the sharded index."<<std::endl;
+        return -1;
+    }
+
+    // Optional arguments.
+    int N = 0;
+    int M = 16;
+    int ef_construction = 100;
+    int num_shards = 4;
+    int num_threads = 0;
+    int reorder_ID = 0;
+    int num_queries = 0;
+    bool build_monolithic = true;
+
+    for (int i = 0; i < argc; ++i){
+        if (std::strcmp("--no_monolithic",argv[i]) == 0){
+            build_monolithic = false;
+        }
+        if (std::strcmp("--N",argv[i]) == 0){
+            if ((i+1) < argc){
+                N = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --N"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--M",argv[i]) == 0){
+            if ((i+1) < argc){
+                M = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --M"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--ef",argv[i]) == 0){
+            if ((i+1) < argc){
+                ef_construction = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --ef"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--shards",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_shards = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --shards"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--threads",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_threads = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --threads"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--reorder_id",argv[i]) == 0){
+            if ((i+1) < argc){
+                reorder_ID = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --reorder_id"<<std::endl;
+                return -1;
+            }
+        }
+        if (std::strcmp("--nq",argv[i]) == 0){
+            if ((i+1) < argc){
+                num_queries = std::stoi(argv[i+1]);
+            } else {
+                std::cerr<<"Invalid argument for optional parameter --nq"<<std::endl;
+                return -1;
+            }
+        }
+    }
+
+    if (M <= 0 || ef_construction <= 0 || num_shards <= 0){
+        std::cerr<<"Invalid arguments: --M, --ef and --shards must be positive integers."<<std::endl;
+        return -1;
+    }
+    if (reorder_ID < 0 || reorder_ID > 8){
+        std::cerr<<"Invalid argument for optional parameter --reorder_id: Must be between 0 and 8."<<std::endl;
+        return -1;
+    }
+    const Index<float, int>::GraphOrder orders[] = {Index<float, int>::GraphOrder::GORDER,
+        Index<float, int>::GraphOrder::GORDER, Index<float, int>::GraphOrder::IN_DEG,
+        Index<float, int>::GraphOrder::OUT_DEG, Index<float, int>::GraphOrder::RCM,
+        Index<float, int>::GraphOrder::HUB_SORT, Index<float, int>::GraphOrder::HUB_CLUSTER,
+        Index<float, int>::GraphOrder::DBG, Index<float, int>::GraphOrder::BCORDER};
+
+    // Positional arguments.
+    int space_ID = std::stoi(argv[2]);
+
+    // Load the data.
+    std::ifstream input(argv[1], std::ios::binary);
+    unsigned int dim;
+    unsigned int num_check;
+    input.read((char*)&num_check, 4);
+    input.read((char*)&dim, 4);
+    if (N <= 0){
+        N = num_check;
+    }
+    std::clog<<"Reading "<<N<<" points of "<<num_check<<" total points of dimension "<<dim<<"."<<std::endl;
+    float* data = new float[(size_t)(N) * dim];
+    input.read((char*)data, (size_t)(N) * dim * 4);
+    input.close();
+    std::vector<int> labels(N);
+    for (int i = 0; i < N; i++){
+        labels[i] = i;
+    }
+
+    // Load queries.
+    std::ifstream querystream(argv[3], std::ios::binary);
+    unsigned int num_queries_check;
+    unsigned int query_dim;
+    querystream.read((char*)&num_queries_check, 4);
+    querystream.read((char*)&query_dim, 4);
+    if (query_dim != dim){
+        std::cerr<<"Error: Queries have dimension "<<query_dim<<" but data has dimension "<<dim<<"."<<std::endl;
+        return -1;
+    }
+    if (num_queries == 0){
+        num_queries = num_queries_check;
+    }
+    float* queries = new float[num_queries * dim];
+    querystream.read((char*)queries, (size_t)(num_queries) * dim * 4);
+    querystream.close();
+
+    // Load ground truth.
+    std::ifstream truthstream(argv[4], std::ios::binary);
+    int num_gtruth_lists;
+    int num_gtruth_entries;
+    truthstream.read((char*)&num_gtruth_lists, 4);
+    truthstream.read((char*)&num_gtruth_entries, 4);
+    if (num_gtruth_lists < num_queries){
+        std::cerr<<"Error: Need at least "<<num_queries<<" gtruth lists."<<std::endl;
+        return -1;
+    }
+    unsigned int* gtruth = new unsigned int[num_gtruth_lists * num_gtruth_entries];
+    truthstream.read((char*)gtruth, (size_t)(num_gtruth_lists) * num_gtruth_entries * 4);
+    truthstream.close();
+
+    // EF search vector.
+    std::vector<int> ef_searches;
+    std::stringstream ss(argv[5]);
+    int element = 0;
+    while(ss >> element){
+        ef_searches.push_back(element);
+        if (ss.peek() == ',') ss.ignore();
+    }
+    int k = std::stoi(argv[6]);
+    if (k > num_gtruth_entries){
+        std::cerr<<"K is larger than the number of precomputed ground truth neighbors."<<std::endl;
+        return -1;
+    }
+
+    SpaceInterface<float>* space;
+    if (space_ID == 0){
+        space = new L2Space(dim);
+    } else {
+        space = new InnerProductSpace(dim);
+    }
+
+    // Build (and optionally reorder) the sharded index.
+    std::clog<<"Building "<<num_shards<<" shards with "<<resolve_num_threads(num_threads)<<" threads."<<std::endl;
+    ShardedIndex<float, int> sharded(space, num_shards, N, M);
+    auto start = std::chrono::high_resolution_clock::now();
+    sharded.add_batch(data, labels.data(), N, ef_construction, num_threads);
+    if (reorder_ID > 0){
+        sharded.reorder(orders[reorder_ID], num_threads);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    double sharded_build_s = std::chrono::duration<double>(stop - start).count();
+    std::clog<<"Sharded build time: "<<sharded_build_s<<" seconds"<<std::endl;
+
+    // Build (and optionally reorder) the monolithic index.
+    Index<float, int>* monolithic = NULL;
+    double monolithic_build_s = 0;
+    if (build_monolithic){
+        std::clog<<"Building monolithic index."<<std::endl;
+        monolithic = new Index<float, int>(space, N, M);
+        start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < N; i++){
+            monolithic->add(data + (size_t)(i) * dim, labels[i], ef_construction);
+        }
+        if (reorder_ID > 0){
+            monolithic->reorder(orders[reorder_ID]);
+        }
+        stop = std::chrono::high_resolution_clock::now();
+        monolithic_build_s = std::chrono::duration<double>(stop - start).count();
+        std::clog<<"Monolithic build time: "<<monolithic_build_s<<" seconds"<<std::endl;
+    }
+
+    std::vector<double> recalls(num_queries);
+    std::cout<<"index,shards,ef_search,recall,qps,build_s"<<std::endl;
+    for (int ef_search : ef_searches){
+        start = std::chrono::high_resolution_clock::now();
+        std::vector<std::vector<std::pair<float, int> > > results = sharded.search_batch(queries, num_queries, k, ef_search,
+            num_threads);
+        stop = std::chrono::high_resolution_clock::now();
+        double recall = 0;
+        for (int i = 0; i < num_queries; i++){ recall += recall_at_k(results[i], gtruth + num_gtruth_entries*i, k); }
+        double qps = num_queries / std::chrono::duration<double>(stop - start).count();
+        std::cout<<"sharded,"<<num_shards<<","<<ef_search<<","<<recall / num_queries<<","<<qps<<","<<sharded_build_s<<std::endl;
+
+        if (monolithic == NULL){ continue; }
+        start = std::chrono::high_resolution_clock::now();
+        parallel_for(0, num_queries, num_threads, [&](size_t i, int thread_id){
+            std::vector<std::pair<float, int> > result = monolithic->search(queries + dim*i, k, ef_search);
+            recalls[i] = recall_at_k(result, gtruth + num_gtruth_entries*i, k);
+        });
+        stop = std::chrono::high_resolution_clock::now();
+        recall = 0;
+        for (int i = 0; i < num_queries; i++){ recall += recalls[i]; }
+        qps = num_queries / std::chrono::duration<double>(stop - start).count();
+        std::cout<<"monolithic,1,"<<ef_search<<","<<recall / num_queries<<","<<qps<<","<<monolithic_build_s<<std::endl;
+    }
+
+    delete monolithic;
+    delete[] data;
+    delete[] queries;
+    delete[] gtruth;
+    return 0;
+}